@@ -0,0 +1,29 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2023 tuorqai
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+// libsecam.c: implementation of libsecam as a compiled library
+//
+// Built by libsecam_shared and libsecam_static targets, with line kernels
+// for several instruction sets (LIBSECAM_MULTIVERSION). Programs linked to
+// either of them get LIBSECAM_LINKED defined, which makes the header ignore
+// LIBSECAM_IMPLEMENTATION, so they don't need to change.
+//------------------------------------------------------------------------------
+
+#define LIBSECAM_IMPLEMENTATION
+#include "libsecam.h"
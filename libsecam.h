@@ -24,7 +24,156 @@
 // Output is the same format.
 // Width should be divisible by 8, height should be divisible by 2.
 //
+// Threading backend is selected at compile time:
+// LIBSECAM_USE_THREADS: own worker threads (pthreads or Win32 threads),
+// LIBSECAM_USE_OPENMP: bands are OpenMP tasks, if the filter is called from
+//                      inside a parallel region, they run on the thread team
+//                      of that region, otherwise a new region is started,
+// neither: everything runs on the calling thread.
+//
+// The header is the whole library: define LIBSECAM_IMPLEMENTATION in one
+// source file before including it. Alternatively, CMake builds it once as
+// libsecam_shared or libsecam_static (libsecam.c), with hidden symbols and
+// line kernels compiled for SSE4.2 and AVX2 besides baseline x86-64, one of
+// which is picked when the program is loaded (LIBSECAM_MULTIVERSION, needs
+// GCC or Clang with glibc). Programs linked to those get LIBSECAM_LINKED,
+// which makes the header ignore LIBSECAM_IMPLEMENTATION. Output is the same
+// whichever kernels run. LIBSECAM_SHARED marks public functions as imported
+// from the shared library.
+//
+// Each instance has its own worker threads, unless it's created by
+// libsecam_init_shared(), in which case it uses worker threads of the given
+// engine. One engine can serve any number of instances, frames of different
+// instances are processed band by band in turns. Instances should be closed
+// before their engine.
+//
+// libsecam_set_threads() sets the number of bands each frame is split into,
+// i.e. how many worker threads the instance may keep busy at once.
+// Noise is seeded from libsecam_seed(), frame number and band, so the output
+// doesn't depend on thread scheduling (it does depend on the band count).
+//
+// libsecam_filter_to_buffer() and other functions filtering whole frames
+// return false if there wasn't enough memory for some band's line buffers,
+// in which case rows of that band are left untouched. libsecam_filter()
+// returns NULL then.
+//
+// Other pixel formats are supported by libsecam_filter_image(), which takes
+// image descriptions with a format, plane pointers and pitches.
+// Source and destination formats may differ. Planar YUV formats are limited
+// range BT.601, which is what the filter works in, so they skip conversion.
+// 16-bit and float formats are converted right in the line kernels, without
+// passes over the whole frame, but the filter itself still works with 8 bits
+// per sample, so finer detail of the source is lost. Their samples are in
+// native byte order, planes and pitches should be aligned to sample size.
+// Alpha is written as opaque, same as the unused byte of XRGB.
+//
+// Hosts with their own thread pools (slice threading of video frameworks etc.)
+// may skip the engine: call libsecam_begin_frame() once per frame, then
+// libsecam_filter_rows() for any number of row ranges, from any threads.
+// Ranges of one frame must not overlap, every thread needs its own scratch
+// from libsecam_scratch_init(). Noise depends on where the ranges start.
+// libsecam_begin_image() and libsecam_filter_image_rows() do the same for
+// other pixel formats.
+//
+// Streaming mode takes a frame line by line, for sources which deliver
+// scanlines progressively: libsecam_stream_begin(), then
+// libsecam_stream_push_line() for each of the height lines, top to bottom,
+// which filters the line right away, then libsecam_stream_end().
+// Skew is based on brightness of the previous frame, since the current one
+// isn't known until its last line. Only a few line buffers are kept.
+//
+// With noise_atlas option, noise is read from tables generated in advance,
+// starting at random offset for every line, instead of calling the random
+// number generator for every pixel. Tables take 4 to 8 bytes per pixel
+// and are regenerated when luma_noise or chroma_noise changes. Resizing
+// keeps their memory, and luma noise too, unless the frame gets larger.
+//
+// libsecam_resize() changes frame size of an instance, e.g. when resolution
+// of a stream changes. Options, seed, frame counter and worker threads stay,
+// buffers grow at least twice at a time and don't shrink, so switching back
+// and forth between a few sizes doesn't reallocate anything. It returns false
+// if the size isn't positive or there's not enough memory, in which case
+// the size stays the same.
+// Should not be called while a frame is being filtered.
+//
+// libsecam_set_deadline() turns on the quality governor for live output,
+// where every frame has to be ready in time (e.g. 20 ms for PAL). Frames
+// filtered by libsecam_filter_image() and functions built on it are timed,
+// and when one of them comes close to the deadline, quality of the following
+// ones is lowered a level at a time: noise is taken from the atlas and echo
+// is skipped, then luma loss is averaged over half as many pixels, then only
+// every other line is filtered, the rest repeat the line above. Quality is
+// raised back once frames are well within the deadline for a while. The
+// atlas is kept ready while the deadline is set, so switching to it doesn't
+// take a frame's time. libsecam_governor_stats() tells current quality, how
+// many frames were late and how often quality changed, the callback set by
+// libsecam_set_governor_callback() is called on every change, from the thread
+// which filtered the frame. Zero deadline turns the governor off and restores
+// full quality. Slices and streaming aren't timed.
+//
+// libsecam_autotune() picks the number of bands each frame is split into, by
+// timing a few test frames with every candidate count, from a quarter of the
+// worker threads to four bands per thread (more bands balance better, but
+// each one converts an extra line). Result is returned and set as if by
+// libsecam_set_threads(). With that count, it then times cached against
+// non-temporal output stores (see below) and keeps the faster, as if by
+// libsecam_set_nontemporal_threshold() with 0 or (size_t) -1. Line kernels
+// aren't among the choices, those for the CPU are picked when the program
+// is loaded. Test frames don't change noise or skew of the real ones. With
+// a wisdom file, results are kept there, one line per processor model,
+// frame size and thread count, and taken from it next time without
+// measuring anything. The file is plain text and may be
+// shared between machines. The first run filters a few dozen test frames,
+// it should not be called while a frame is being filtered. Returns 0 if
+// there's not enough memory for the test frames.
+//
+// Frames larger than the last level cache are written with non-temporal
+// stores, which go past the cache: output rows are never read back, and
+// writing them through the cache would evict source rows and line buffers,
+// and read every destination line from memory before overwriting it. Each
+// row is packed into a line buffer and streamed out from there. Size of
+// the cache is found at init, libsecam_set_nontemporal_threshold() sets
+// another output frame size in bytes, above which it's done: 0 is every
+// frame, (size_t) -1 is none. Needs SSE2, applies to formats of one plane,
+// not to streaming.
+//
+// With LIBSECAM_TRACE defined, every frame, its brightness pre-pass, every
+// band and every stage of every line are timed and recorded into per-thread
+// rings of LIBSECAM_TRACE_EVENTS events. libsecam_trace_dump() writes them
+// to a file in Chrome trace format, which can be opened in Perfetto or
+// chrome://tracing. libsecam_trace_clear() drops recorded events. Neither
+// should be called while frames are being filtered. Without the macro,
+// tracing isn't compiled at all. Other profilers can take the same stages
+// by defining LIBSECAM_TRACE_BEGIN() and LIBSECAM_TRACE_END() before the
+// implementation, instead of LIBSECAM_TRACE (see ueit --perf).
+//
+// libsecam_filter_region() filters only a width * height rectangle of a
+// larger frame, placed at left, top. Frame rows are src_pitch and dst_pitch bytes
+// apart. Pixels of dst outside of the rectangle are left untouched.
+//
 // Version history:
+//      4.22    2026.10.18  Non-temporal output stores
+//      4.21    2026.10.18  libsecam-server and client library
+//      4.20    2026.10.18  Overridable stage hooks, ueit --perf
+//      4.19    2026.10.18  Compiled library targets, multiversioned kernels
+//      4.18    2026.10.18  libsecam_autotune(), wisdom file
+//      4.17    2026.10.18  Deadline quality governor
+//      4.16    2026.10.18  Chrome trace export (LIBSECAM_TRACE)
+//      4.15    2026.10.18  libsecam_resize()
+//      4.14    2026.10.18  RGBA64, P010 and RGBA32F formats
+//      4.13    2026.10.18  Vectorisable luma effects
+//      4.12    2026.10.18  Two-pass chroma fire
+//      4.11    2026.10.18  Noise atlas
+//      4.10    2026.10.18  Planar YUV 4:2:0 and 4:4:4 formats, secamify tool
+//      4.9     2026.10.18  Line streaming mode
+//      4.8     2026.10.18  Slice API: libsecam_begin_frame(), libsecam_filter_rows()
+//      4.7     2026.10.18  Pixel formats, libsecam_filter_image(), C++ header
+//      4.6     2026.10.18  OpenMP threading backend
+//      4.5     2026.10.18  Per-instance random seed, libsecam_set_threads()
+//      4.4     2026.10.18  Persistent worker threads, shared engines
+//      4.3     2026.10.18  Region of interest filtering
+//      4.2     2026.10.18  Static content cache
+//      4.1     2026.10.18  Chroma is processed at reduced resolution
 //      4.0     2024.03.30  Almost completely rewritten, added multithreading
 //      3.5a    2024.02.14  Minor updates
 //      3.5     2024.02.14  Update echo effect (no more dark image)
@@ -57,6 +206,11 @@
 //------------------------------------------------------------------------------
 
 #include <stdbool.h>
+#include <stddef.h>
+
+#if defined(LIBSECAM_USE_THREADS) && defined(LIBSECAM_USE_OPENMP)
+#   error "LIBSECAM_USE_THREADS and LIBSECAM_USE_OPENMP are mutually exclusive"
+#endif
 
 #ifdef LIBSECAM_USE_THREADS
 #   ifdef _WIN32
@@ -64,6 +218,7 @@
 #       include <windows.h>
 #   else
 #       include <pthread.h>
+#       include <unistd.h>
 #   endif
 #endif
 
@@ -78,7 +233,33 @@
 
 //------------------------------------------------------------------------------
 
+#if !defined(LIBSECAM_API)
+#   if defined(LIBSECAM_SHARED) && defined(_WIN32)
+#       if defined(LIBSECAM_EXPORTS)
+#           define LIBSECAM_API __declspec(dllexport)
+#       else
+#           define LIBSECAM_API __declspec(dllimport)
+#       endif
+#   elif defined(LIBSECAM_SHARED) && defined(__GNUC__)
+#       define LIBSECAM_API __attribute__((visibility("default")))
+#   else
+#       define LIBSECAM_API
+#   endif
+#endif
+
+// Implementation comes from libsecam_shared or libsecam_static.
+#if defined(LIBSECAM_LINKED) && defined(LIBSECAM_IMPLEMENTATION)
+#   undef LIBSECAM_IMPLEMENTATION
+#endif
+
+// Seed of a new instance, until libsecam_seed() is called.
+#define LIBSECAM_DEFAULT_SEED 0xdeadcafe
+
+//------------------------------------------------------------------------------
+
 typedef struct libsecam_s libsecam_t;
+typedef struct libsecam_engine_s libsecam_engine_t;
+typedef struct libsecam_scratch_s libsecam_scratch_t;
 
 //------------------------------------------------------------------------------
 
@@ -86,6 +267,28 @@ typedef struct libsecam_s libsecam_t;
 extern "C" {
 #endif
 
+typedef enum libsecam_format
+{
+    LIBSECAM_FORMAT_XRGB,           // 4 bytes: red, green, blue, unused
+    LIBSECAM_FORMAT_XBGR,           // 4 bytes: blue, green, red, unused
+    LIBSECAM_FORMAT_RGB24,          // 3 bytes: red, green, blue
+    LIBSECAM_FORMAT_BGR24,          // 3 bytes: blue, green, red
+    LIBSECAM_FORMAT_YUV420P,        // planes: Y, Cb, Cr at half width and height
+    LIBSECAM_FORMAT_YUV444P,        // planes: Y, Cb, Cr at full resolution
+    LIBSECAM_FORMAT_RGBA64,         // 8 bytes: red, green, blue, alpha, 16 bits each
+    LIBSECAM_FORMAT_P010,           // planes: Y, CbCr pairs at half width and height,
+                                    // 16-bit samples with 10 bits in the high bits
+    LIBSECAM_FORMAT_RGBA32F,        // 16 bytes: red, green, blue, alpha floats, 0.0 to 1.0
+    LIBSECAM_TOTAL_FORMATS,
+} libsecam_format_t;
+
+typedef struct libsecam_image
+{
+    libsecam_format_t format;
+    unsigned char *planes[3];       // packed formats use only the first one
+    int pitches[3];                 // distance between rows, in bytes
+} libsecam_image_t;
+
 typedef struct libsecam_options
 {
     double luma_noise;              // range: 0.0 to 1.0
@@ -94,13 +297,78 @@ typedef struct libsecam_options
     int echo;                       // range: 0 to whatever
     int skew;                       // range: 0 to whatever
     int wobble;                     // range: 0 to whatever
+    bool static_cache;              // reuse conversion of unchanged rows
+    bool noise_atlas;               // take noise from precomputed tables
 } libsecam_options_t;
 
-libsecam_t *libsecam_init(int width, int height);
-void libsecam_close(libsecam_t *self);
-void libsecam_filter_to_buffer(libsecam_t *self, unsigned char const *src, unsigned char *dst);
-unsigned char const *libsecam_filter(libsecam_t *self, unsigned char const *src);
-libsecam_options_t *libsecam_options(libsecam_t *self);
+typedef enum libsecam_quality
+{
+    LIBSECAM_QUALITY_FULL,
+    LIBSECAM_QUALITY_FAST_NOISE,    // noise from the atlas, no echo
+    LIBSECAM_QUALITY_SHORT_LOSS,    // and luma loss over half as many pixels
+    LIBSECAM_QUALITY_HALF_LINES,    // and every other line repeats the one above
+    LIBSECAM_TOTAL_QUALITY_LEVELS,
+} libsecam_quality_t;
+
+typedef struct libsecam_governor_stats
+{
+    libsecam_quality_t quality;     // quality of the next frame
+    int frames;                     // frames timed since the deadline was set
+    int missed;                     // frames which took longer than the deadline
+    int degrades;                   // times quality was lowered
+    int restores;                   // times quality was raised
+    double last_ms;                 // time of the last frame, in milliseconds
+    double average_ms;              // moving average of frame time
+    double worst_ms;                // longest frame
+} libsecam_governor_stats_t;
+
+// Called when the governor changes quality, stats have the new one.
+typedef void (*libsecam_governor_func_t)(void *user,
+    libsecam_governor_stats_t const *stats, libsecam_quality_t previous);
+
+LIBSECAM_API libsecam_engine_t *libsecam_engine_init(int num_threads);
+LIBSECAM_API void libsecam_engine_close(libsecam_engine_t *engine);
+
+LIBSECAM_API libsecam_t *libsecam_init(int width, int height);
+LIBSECAM_API libsecam_t *libsecam_init_shared(libsecam_engine_t *engine, int width, int height);
+LIBSECAM_API void libsecam_close(libsecam_t *self);
+LIBSECAM_API bool libsecam_resize(libsecam_t *self, int width, int height);
+LIBSECAM_API bool libsecam_filter_to_buffer(libsecam_t *self, unsigned char const *src, unsigned char *dst);
+LIBSECAM_API unsigned char const *libsecam_filter(libsecam_t *self, unsigned char const *src);
+LIBSECAM_API bool libsecam_filter_region(libsecam_t *self, unsigned char const *src, int src_pitch,
+    unsigned char *dst, int dst_pitch, int left, int top);
+LIBSECAM_API bool libsecam_filter_image(libsecam_t *self, libsecam_image_t const *src,
+    libsecam_image_t const *dst);
+LIBSECAM_API libsecam_options_t *libsecam_options(libsecam_t *self);
+LIBSECAM_API void libsecam_hint_unchanged(libsecam_t *self);
+LIBSECAM_API void libsecam_set_threads(libsecam_t *self, int num_threads);
+LIBSECAM_API void libsecam_seed(libsecam_t *self, unsigned int seed);
+
+LIBSECAM_API void libsecam_set_deadline(libsecam_t *self, double milliseconds);
+LIBSECAM_API void libsecam_set_governor_callback(libsecam_t *self,
+    libsecam_governor_func_t func, void *user);
+LIBSECAM_API libsecam_governor_stats_t const *libsecam_governor_stats(libsecam_t const *self);
+LIBSECAM_API int libsecam_autotune(libsecam_t *self, char const *wisdom_path);
+LIBSECAM_API void libsecam_set_nontemporal_threshold(libsecam_t *self, size_t bytes);
+
+LIBSECAM_API void libsecam_stream_begin(libsecam_t *self);
+LIBSECAM_API bool libsecam_stream_push_line(libsecam_t *self, unsigned char const *src, unsigned char *dst);
+LIBSECAM_API void libsecam_stream_end(libsecam_t *self);
+
+LIBSECAM_API libsecam_scratch_t *libsecam_scratch_init(void);
+LIBSECAM_API void libsecam_scratch_close(libsecam_scratch_t *scratch);
+LIBSECAM_API void libsecam_begin_frame(libsecam_t *self, unsigned char const *src);
+LIBSECAM_API void libsecam_begin_image(libsecam_t *self, libsecam_image_t const *src);
+LIBSECAM_API void libsecam_filter_rows(libsecam_t *self, int y0, int y1,
+    unsigned char const *src, unsigned char *dst, libsecam_scratch_t *scratch);
+LIBSECAM_API void libsecam_filter_image_rows(libsecam_t *self, int y0, int y1,
+    libsecam_image_t const *src, libsecam_image_t const *dst,
+    libsecam_scratch_t *scratch);
+
+#ifdef LIBSECAM_TRACE
+LIBSECAM_API bool libsecam_trace_dump(char const *path);
+LIBSECAM_API void libsecam_trace_clear(void);
+#endif
 
 #if defined(__cplusplus)
 }
@@ -113,9 +381,56 @@ libsecam_options_t *libsecam_options(libsecam_t *self);
 //------------------------------------------------------------------------------
 
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#   ifndef WIN32_LEAN_AND_MEAN
+#       define WIN32_LEAN_AND_MEAN
+#   endif
+#   include <windows.h>
+#else
+#   include <time.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#   include <unistd.h>
+#endif
+
+// Nothing public depends on OpenMP, so only the implementation needs it.
+#ifdef LIBSECAM_USE_OPENMP
+#   include <omp.h>
+#endif
+
+// Non-temporal stores need SSE2, which every x86-64 CPU has.
+#if !defined(LIBSECAM_NO_NONTEMPORAL) && (defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#   include <emmintrin.h>
+#   define LIBSECAM_HAS_NONTEMPORAL
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#   include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   include <cpuid.h>
+#endif
+
+// With LIBSECAM_MULTIVERSION, line kernels are compiled for several
+// instruction sets and the best one is picked when the program is loaded.
+// Needs ifunc support, i.e. ELF and glibc. FMA is left out on purpose,
+// fused rounding would change the output.
+#if defined(LIBSECAM_MULTIVERSION) && defined(__x86_64__) && defined(__ELF__) \
+    && defined(__GLIBC__) && defined(__has_attribute)
+#   if __has_attribute(target_clones)
+#       define LIBSECAM_KERNEL __attribute__((target_clones("avx2", "sse4.2", "default")))
+#   endif
+#endif
+
+#if !defined(LIBSECAM_KERNEL)
+#define LIBSECAM_KERNEL
+#endif
+
 //------------------------------------------------------------------------------
 
 #if !defined(LIBSECAM_MALLOC)
@@ -142,6 +457,37 @@ libsecam_options_t *libsecam_options(libsecam_t *self);
 #define LIBSECAM_NUM_THREADS        4
 #endif
 
+// Number of chroma samples per chroma loss cell.
+#if !defined(LIBSECAM_CHROMA_SUBSAMPLES)
+#define LIBSECAM_CHROMA_SUBSAMPLES  4
+#endif
+
+// Governor lowers quality when a frame takes more than this part of the
+// deadline and raises it after LIBSECAM_GOVERNOR_RESTORE frames in a row
+// which take less than LIBSECAM_GOVERNOR_CALM of it.
+#if !defined(LIBSECAM_GOVERNOR_RISK)
+#define LIBSECAM_GOVERNOR_RISK      0.85
+#endif
+
+#if !defined(LIBSECAM_GOVERNOR_CALM)
+#define LIBSECAM_GOVERNOR_CALM      0.6
+#endif
+
+#if !defined(LIBSECAM_GOVERNOR_RESTORE)
+#define LIBSECAM_GOVERNOR_RESTORE   30
+#endif
+
+// Frames timed for every band count tried by libsecam_autotune(),
+// the fastest one counts.
+#if !defined(LIBSECAM_AUTOTUNE_FRAMES)
+#define LIBSECAM_AUTOTUNE_FRAMES    3
+#endif
+
+// Last level cache size assumed when it can't be found.
+#if !defined(LIBSECAM_DEFAULT_LLC_SIZE)
+#define LIBSECAM_DEFAULT_LLC_SIZE   (8 << 20)
+#endif
+
 //------------------------------------------------------------------------------
 
 #define LIBSECAM_CLAMP(x, a, b) \
@@ -165,6 +511,152 @@ libsecam_options_t *libsecam_options(libsecam_t *self);
 #define LIBSECAM_YCBCR_TO_B(y, cb, cr) \
     + (298.082 * (y) / 256.0) + (516.412 * (cb) / 256.0) - 276.836
 
+//------------------------------------------------------------------------------
+// Timing
+
+/**
+ * Monotonic time in microseconds. Where there's no monotonic clock,
+ * processor time is used, which is only good for single-threaded builds.
+ */
+static double libsecam_clock(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return counter.QuadPart * 1e6 / frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#else
+    return clock() * 1e6 / CLOCKS_PER_SEC;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Tracing
+
+#ifdef LIBSECAM_TRACE
+
+// Events kept per thread, older ones are overwritten.
+#if !defined(LIBSECAM_TRACE_EVENTS)
+#define LIBSECAM_TRACE_EVENTS       65536
+#endif
+
+#ifdef _MSC_VER
+#   define LIBSECAM_THREAD_LOCAL    __declspec(thread)
+#else
+#   define LIBSECAM_THREAD_LOCAL    __thread
+#endif
+
+struct libsecam_trace_event
+{
+    char const *name;                   // stage, static string
+    char const *arg_name;               // meaning of arg, NULL if none
+    double start;                       // microseconds
+    double end;
+    int frame;
+    int arg;
+};
+
+// Only the owner thread writes to its ring, so there are no locks,
+// count is published after the event is complete.
+struct libsecam_trace_ring
+{
+    struct libsecam_trace_event events[LIBSECAM_TRACE_EVENTS];
+    unsigned int count;                 // events ever recorded
+    int tid;
+    struct libsecam_trace_ring *next;
+};
+
+static struct libsecam_trace_ring *libsecam_trace_rings;
+static int libsecam_trace_threads;
+static LIBSECAM_THREAD_LOCAL struct libsecam_trace_ring *libsecam_trace_ring;
+
+/**
+ * Add ring of the calling thread to the list.
+ */
+static void libsecam_trace_register(struct libsecam_trace_ring *ring)
+{
+#ifdef _WIN32
+    ring->tid = InterlockedIncrement((LONG volatile *) &libsecam_trace_threads);
+
+    do {
+        ring->next = libsecam_trace_rings;
+    } while (InterlockedCompareExchangePointer((PVOID volatile *) &libsecam_trace_rings,
+        ring, ring->next) != ring->next);
+#else
+    ring->tid = __atomic_add_fetch(&libsecam_trace_threads, 1, __ATOMIC_RELAXED);
+    ring->next = __atomic_load_n(&libsecam_trace_rings, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&libsecam_trace_rings, &ring->next, ring,
+        true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+#endif
+}
+
+/**
+ * Record stage which started at the given time and ends now.
+ */
+static void libsecam_trace_event(char const *name, double start, int frame,
+    char const *arg_name, int arg)
+{
+    double end = libsecam_clock();
+    struct libsecam_trace_ring *ring = libsecam_trace_ring;
+
+    if (!ring) {
+        ring = (struct libsecam_trace_ring *) LIBSECAM_MALLOC(sizeof(*ring));
+
+        if (!ring) {
+            return;
+        }
+
+        ring->count = 0;
+        libsecam_trace_register(ring);
+        libsecam_trace_ring = ring;
+    }
+
+    struct libsecam_trace_event *event = &ring->events[ring->count % LIBSECAM_TRACE_EVENTS];
+
+    event->name = name;
+    event->arg_name = arg_name;
+    event->start = start;
+    event->end = end;
+    event->frame = frame;
+    event->arg = arg;
+
+#ifdef _WIN32
+    InterlockedExchange((LONG volatile *) &ring->count, ring->count + 1);
+#else
+    __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+#endif
+}
+
+#if !defined(LIBSECAM_TRACE_BEGIN)
+#define LIBSECAM_TRACE_BEGIN(t) \
+    double t = libsecam_clock()
+
+#define LIBSECAM_TRACE_END(t, name, frame, arg_name, arg) \
+    libsecam_trace_event(name, t, frame, arg_name, arg)
+#endif
+
+#endif // LIBSECAM_TRACE
+
+// Stage hooks, may be defined before the implementation to feed another
+// profiler. BEGIN declares variable t, END gets the same t and a static
+// name of the stage. Stages nest: frame has pre-pass and bands, every band
+// (or rows of the slice API) has line stages.
+#if !defined(LIBSECAM_TRACE_BEGIN)
+#define LIBSECAM_TRACE_BEGIN(t)                             ((void) 0)
+#define LIBSECAM_TRACE_END(t, name, frame, arg_name, arg)   ((void) 0)
+#endif
+
 //------------------------------------------------------------------------------
 
 #ifdef LIBSECAM_USE_THREADS
@@ -182,6 +674,57 @@ static void libsecam_create_thread(LPHANDLE threadp, libsecam_thread_func_t f, L
 static void libsecam_wait_thread(HANDLE thread)
 {
     WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+typedef CRITICAL_SECTION libsecam_mutex_t;
+typedef CONDITION_VARIABLE libsecam_cond_t;
+
+static void libsecam_init_mutex(libsecam_mutex_t *mutex)
+{
+    InitializeCriticalSection(mutex);
+}
+
+static void libsecam_destroy_mutex(libsecam_mutex_t *mutex)
+{
+    DeleteCriticalSection(mutex);
+}
+
+static void libsecam_lock_mutex(libsecam_mutex_t *mutex)
+{
+    EnterCriticalSection(mutex);
+}
+
+static void libsecam_unlock_mutex(libsecam_mutex_t *mutex)
+{
+    LeaveCriticalSection(mutex);
+}
+
+static void libsecam_init_cond(libsecam_cond_t *cond)
+{
+    InitializeConditionVariable(cond);
+}
+
+static void libsecam_destroy_cond(libsecam_cond_t *cond)
+{
+    (void) cond;
+}
+
+static void libsecam_wait_cond(libsecam_cond_t *cond, libsecam_mutex_t *mutex)
+{
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+static void libsecam_broadcast_cond(libsecam_cond_t *cond)
+{
+    WakeAllConditionVariable(cond);
+}
+
+static int libsecam_count_cpus(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
 }
 
 #else
@@ -199,12 +742,150 @@ static void libsecam_wait_thread(libsecam_thread_t thread)
     pthread_join(thread, NULL);
 }
 
+typedef pthread_mutex_t libsecam_mutex_t;
+typedef pthread_cond_t libsecam_cond_t;
+
+static void libsecam_init_mutex(libsecam_mutex_t *mutex)
+{
+    pthread_mutex_init(mutex, NULL);
+}
+
+static void libsecam_destroy_mutex(libsecam_mutex_t *mutex)
+{
+    pthread_mutex_destroy(mutex);
+}
+
+static void libsecam_lock_mutex(libsecam_mutex_t *mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+static void libsecam_unlock_mutex(libsecam_mutex_t *mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+
+static void libsecam_init_cond(libsecam_cond_t *cond)
+{
+    pthread_cond_init(cond, NULL);
+}
+
+static void libsecam_destroy_cond(libsecam_cond_t *cond)
+{
+    pthread_cond_destroy(cond);
+}
+
+static void libsecam_wait_cond(libsecam_cond_t *cond, libsecam_mutex_t *mutex)
+{
+    pthread_cond_wait(cond, mutex);
+}
+
+static void libsecam_broadcast_cond(libsecam_cond_t *cond)
+{
+    pthread_cond_broadcast(cond);
+}
+
+static int libsecam_count_cpus(void)
+{
+    return (int) sysconf(_SC_NPROCESSORS_ONLN);
+}
+
 #endif // _WIN32
 
 #endif // LIBSECAM_USE_THREADS
 
 //------------------------------------------------------------------------------
 
+// Line buffers needed to filter one band of rows.
+// Chroma buffers are chroma_width long, one sample per chroma_step pixels.
+struct libsecam_scratch_s
+{
+    int width;                          // capacity of luminance buffers
+    int chroma_width;                   // capacity of chrominance buffers
+
+    int *luma;                          // luminance buffer
+    int *osci;                          // luminance "oscillation" buffer
+    int *luma_work;                     // noise, then oscillation of every pixel
+    int *cb;                            // blue chroma buffer
+    int *cr;                            // red chroma buffer
+    int *cx;                            // prev chroma buffer
+                                        // SECAM is "color with memory" after all...
+
+    unsigned char *row_luma;            // unpacked source line
+    signed char *row_cb;
+    signed char *row_cr;
+
+    int *out_luma;                      // filtered line, ready to be packed
+    int *out_cb;
+    int *out_cr;
+    unsigned char *out_row;             // packed line, streamed to the output
+
+    unsigned int *chroma_rand;          // random number of every chroma sample
+    unsigned char *fire_mask;           // samples where fire may start
+    int *fire_list;                     // positions of those samples
+
+    int luma_noise[255];                // luma noise of every random value
+    unsigned int rng;                   // random state of the current band
+    int phase;                          // chroma of the next line, 0 is Cb, 1 is Cr
+};
+
+/**
+ * Pre-scaled noise, size entries followed by a line of padding, which
+ * repeats the start, so a line can be read from any offset.
+ */
+struct libsecam_atlas
+{
+    short *noise;
+    int size;                           // power of two
+    int capacity;                       // entries allocated, with padding
+    int filled;                         // leading entries made for the scale
+    double scale;
+};
+
+// Bands of one frame waiting to be processed by engine workers.
+struct libsecam_batch
+{
+    libsecam_t *self;
+    libsecam_image_t src;
+    libsecam_image_t dst;
+
+    int num_bands;
+    int next_band;                      // first band not taken by a worker yet
+    int pending;                        // bands not finished yet
+    bool failed;                        // a band had no memory for scratch
+
+    struct libsecam_batch *next;
+};
+
+#ifdef LIBSECAM_USE_THREADS
+
+struct libsecam_worker
+{
+    libsecam_engine_t *engine;
+    struct libsecam_scratch_s scratch;    // reused for every band the worker takes
+    libsecam_thread_t thread;
+};
+
+#endif
+
+struct libsecam_engine_s
+{
+    int num_threads;
+
+#ifdef LIBSECAM_USE_THREADS
+    struct libsecam_worker *workers;
+
+    libsecam_mutex_t mutex;
+    libsecam_cond_t wake;               // signaled when new batch is queued
+    libsecam_cond_t done;               // signaled when batch is finished
+
+    struct libsecam_batch *head;        // queue of unfinished batches
+    struct libsecam_batch *tail;
+
+    bool quit;
+#endif
+};
+
 struct libsecam_s
 {
     libsecam_options_t options;
@@ -212,42 +893,67 @@ struct libsecam_s
     int width;
     int height;
 
-    // line buffers:
+    libsecam_engine_t *engine;
+    bool owns_engine;
+    int num_bands;
 
-    int *luma[LIBSECAM_NUM_THREADS];    // luminance buffer
-    int *osci[LIBSECAM_NUM_THREADS];    // luminance "oscillation" buffer
-    int *cb[LIBSECAM_NUM_THREADS];      // blue chroma buffer
-    int *cr[LIBSECAM_NUM_THREADS];      // red chroma buffer
-    int *cx[LIBSECAM_NUM_THREADS];      // prev chroma buffer
-                                        // SECAM is "color with memory" after all...
+    struct libsecam_scratch_s scratch;    // used if the engine has no workers
+
+#ifdef LIBSECAM_USE_OPENMP
+    struct libsecam_scratch_s *band_scratch;  // one per band
+    int band_scratch_count;
+#endif
+
+    int row_capacity;                   // rows per-row buffers have room for
+    size_t frame_capacity;              // pixels frame buffers have room for
 
     double *vertical_noise;             // used for wobble effect
     double *vertical_level;             // used for skew effect
 
+    // static content cache:
+
+    double *row_level;                  // brightness of each source row
+    unsigned long long *row_hash;       // hash of each source row
+    bool *row_dirty;                    // row has changed since last frame
+    unsigned char *cached_luma;         // unpacked source frame
+    signed char *cached_cb;
+    signed char *cached_cr;
+    bool cache_valid;
+    bool hint_unchanged;
+
     int luma_loss;
     int chroma_loss;
+    int chroma_step;
+    int chroma_width;
+
+    // noise atlas:
+
+    struct libsecam_atlas luma_atlas;
+    struct libsecam_atlas chroma_atlas;
+    int atlas_width;                    // frame size the atlas was built for
+    int atlas_height;
 
     unsigned char *output;
 
+    unsigned int seed;
+    unsigned int rng;                   // random state of the main thread
+
     int frame_count;
-};
+    int stream_line;                    // next line of streamed frame, -1 if not streaming
 
-#ifdef LIBSECAM_USE_THREADS
+    // deadline governor:
 
-struct libsecam_job
-{
-    libsecam_t *self;
-    int id;
-    int y0;
-    int y1;
-    unsigned char const *src;
-    unsigned char *dst;
+    double deadline;                    // milliseconds, 0 if the governor is off
+    libsecam_governor_stats_t governor;
+    int calm_frames;                    // frames in a row well within the deadline
+    int restore_after;                  // calm frames it takes to raise quality
+    int since_restore;                  // frames since quality was raised, -1 if it held
+    libsecam_governor_func_t governor_func;
+    void *governor_user;
 
-    libsecam_thread_t thread;
+    size_t nontemporal_threshold;       // output frame size to stream above
 };
 
-#endif
-
 //------------------------------------------------------------------------------
 
 /**
@@ -279,360 +985,2647 @@ static void libsecam_lerp_line(double *line, int length, int step)
 /**
  * Fast random number generator.
  */
-static int libsecam_fastrand(void)
+static int libsecam_fastrand(unsigned int *state)
 {
-    static int seed = 0xdeadcafe;
-    seed = 214013 * seed + 2531011;
-    return (seed >> 16) & 0x7fff;
+    *state = 214013u * *state + 2531011u;
+    return (*state >> 16) & 0x7fff;
 }
 
 /**
- * Convert RGB line to YCbCr.
+ * Mix seed, frame number and row into initial random state.
  */
-static void libsecam_convert_line(libsecam_t *self, unsigned char const *src,
-    int *luma, int *cb, int *cr, int y)
+static unsigned int libsecam_mix_seed(unsigned int seed, int frame, int row)
 {
-    int shift = 0;
-
-    if (self->options.wobble) {
-        shift += self->vertical_noise[y] * self->options.wobble;
-    }
-
-    if (self->options.skew) {
-        shift += self->vertical_level[y] * self->options.skew;
-    }
+    unsigned int h = seed;
 
-    for (int x = 0; x < self->width; x++) {
-        int n = x - shift;
+    h = (h ^ (unsigned int) frame) * 0x9e3779b1u;
+    h = (h ^ (h >> 15) ^ (unsigned int) row) * 0x85ebca77u;
+    h ^= h >> 13;
 
-        double r = 0.0;
-        double g = 0.0;
-        double b = 0.0;
+    return h;
+}
 
-        if (n >= 0 && n < self->width) {
-            r = src[4 * n + 0] / 255.0;
-            g = src[4 * n + 1] / 255.0;
-            b = src[4 * n + 2] / 255.0;
-        }
+/**
+ * Random start of a line of noise in the atlas.
+ * The atlas is padded, so a whole line can be read from there.
+ */
+static int libsecam_atlas_offset(unsigned int *rng, int size)
+{
+    int r = (libsecam_fastrand(rng) << 15) | libsecam_fastrand(rng);
+    return r & (size - 1);
+}
 
-        luma[x] = LIBSECAM_RGB_TO_Y(r, g, b);
-        cb[x] = LIBSECAM_RGB_TO_CB(r, g, b);
-        cr[x] = LIBSECAM_RGB_TO_CR(r, g, b);
-    }
+/**
+ * Noise is taken from the atlas if it's enabled in options,
+ * or if the governor has lowered quality.
+ */
+static inline bool libsecam_fast_noise(libsecam_t const *self)
+{
+    return self->luma_atlas.noise && (self->options.noise_atlas
+        || self->governor.quality >= LIBSECAM_QUALITY_FAST_NOISE);
 }
 
 /**
- * Convert YCbCr line to RGB.
+ * Random number of a position in line.
+ * Doesn't depend on previous ones, unlike libsecam_fastrand(),
+ * so whole line of them can be computed at once.
  */
-static void libsecam_revert_line(libsecam_t *self, unsigned char *dst,
-    int *luma, int *cb, int *cr)
+static inline unsigned int libsecam_hash_position(unsigned int key, int x)
 {
-    double luma_factor = 1.0 / self->luma_loss;
-    double chroma_factor = 1.0 / self->chroma_loss;
+    unsigned int h = key ^ ((unsigned int) x * 0x9e3779b1u);
 
-    for (int x = 0; x < self->width; x++) {
-        int y_val = 0;
-        int cb_val = 0;
-        int cr_val = 0;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
 
-        for (int i = 0; i < self->luma_loss; i++) {
-            int n = x - i;
+    return h;
+}
 
-            if (n >= 0 && n < self->width) {
-                y_val += luma_factor * luma[n];
-            }
-        }
+//------------------------------------------------------------------------------
+// Pixel formats
 
-        for (int i = 0; i < self->chroma_loss; i++) {
-            int n = x - i;
+typedef void (*libsecam_unpack_func_t)(libsecam_t const *self,
+    libsecam_image_t const *image, int y,
+    unsigned char *luma, signed char *cb, signed char *cr);
 
-            if (n >= 0 && n < self->width) {
-                cb_val += chroma_factor * cb[n];
-                cr_val += chroma_factor * cr[n];
-            }
+typedef void (*libsecam_pack_func_t)(libsecam_t const *self,
+    libsecam_image_t const *image, int y,
+    int const *luma, int const *cb, int const *cr);
+
+typedef double (*libsecam_level_func_t)(libsecam_t const *self,
+    libsecam_image_t const *image, int y);
+
+struct libsecam_format_info
+{
+    int num_planes;
+    int bytes_per_pixel[3];             // per plane, after subsampling
+    int hshift[3];                      // horizontal subsampling of a plane
+    int vshift[3];                      // vertical subsampling of a plane
+
+    libsecam_unpack_func_t unpack;      // line to unshifted YCbCr
+    libsecam_pack_func_t pack;          // filtered YCbCr to line
+    libsecam_level_func_t level;        // brightness of line, 0.0 to 1.0
+};
+
+/**
+ * Get pointer to a row of the image plane.
+ */
+static inline unsigned char *libsecam_image_row(libsecam_image_t const *image,
+    int plane, int y)
+{
+    return image->planes[plane] + (size_t) image->pitches[plane] * y;
+}
+
+/**
+ * Unpack RGB line to YCbCr.
+ * Channel offsets are constants at every call site, so each format gets
+ * its own specialized copy of the loop.
+ */
+static inline void libsecam_unpack_rgb(libsecam_t const *self,
+    unsigned char const *src, int bpp, int ri, int gi, int bi,
+    unsigned char *luma, signed char *cb, signed char *cr)
+{
+    for (int x = 0; x < self->width; x++) {
+        double r = src[bpp * x + ri] / 255.0;
+        double g = src[bpp * x + gi] / 255.0;
+        double b = src[bpp * x + bi] / 255.0;
+
+        luma[x] = (int) (LIBSECAM_RGB_TO_Y(r, g, b));
+        cb[x] = (int) (LIBSECAM_RGB_TO_CB(r, g, b));
+        cr[x] = (int) (LIBSECAM_RGB_TO_CR(r, g, b));
+    }
+}
+
+/**
+ * Pack YCbCr line to RGB.
+ */
+static inline void libsecam_pack_rgb(libsecam_t const *self,
+    unsigned char *dst, int bpp, int ri, int gi, int bi,
+    int const *luma, int const *cb, int const *cr)
+{
+    for (int x = 0; x < self->width; x++) {
+        int r = LIBSECAM_YCBCR_TO_R(luma[x], 128 + cb[x], 128 + cr[x]);
+        int g = LIBSECAM_YCBCR_TO_G(luma[x], 128 + cb[x], 128 + cr[x]);
+        int b = LIBSECAM_YCBCR_TO_B(luma[x], 128 + cb[x], 128 + cr[x]);
+
+        dst[bpp * x + ri] = LIBSECAM_CLAMP(r, 0, 255);
+        dst[bpp * x + gi] = LIBSECAM_CLAMP(g, 0, 255);
+        dst[bpp * x + bi] = LIBSECAM_CLAMP(b, 0, 255);
+
+        if (bpp == 4) {
+            dst[bpp * x + 3] = 255;
         }
+    }
+}
 
-        int r = LIBSECAM_YCBCR_TO_R(y_val, 128 + cb_val, 128 + cr_val);
-        int g = LIBSECAM_YCBCR_TO_G(y_val, 128 + cb_val, 128 + cr_val);
-        int b = LIBSECAM_YCBCR_TO_B(y_val, 128 + cb_val, 128 + cr_val);
+/**
+ * Measure brightness of RGB line real quick.
+ */
+static inline double libsecam_level_rgb(libsecam_t const *self,
+    unsigned char const *src, int bpp, int gi)
+{
+    int brightness = 0;
 
-        dst[4 * x + 0] = LIBSECAM_CLAMP(r, 0, 255);
-        dst[4 * x + 1] = LIBSECAM_CLAMP(g, 0, 255);
-        dst[4 * x + 2] = LIBSECAM_CLAMP(b, 0, 255);
-        dst[4 * x + 3] = 255;
+    for (int x = 0; x < self->width; x++) {
+        int green = src[bpp * x + gi];
+        brightness += green;
     }
+
+    return brightness / self->width / 255.0;
 }
 
+#define LIBSECAM_DEFINE_RGB_FORMAT(name, bpp, ri, gi, bi) \
+    LIBSECAM_KERNEL static void libsecam_unpack_##name(libsecam_t const *self, \
+        libsecam_image_t const *image, int y, \
+        unsigned char *luma, signed char *cb, signed char *cr) \
+    { \
+        libsecam_unpack_rgb(self, libsecam_image_row(image, 0, y), \
+            bpp, ri, gi, bi, luma, cb, cr); \
+    } \
+    LIBSECAM_KERNEL static void libsecam_pack_##name(libsecam_t const *self, \
+        libsecam_image_t const *image, int y, \
+        int const *luma, int const *cb, int const *cr) \
+    { \
+        libsecam_pack_rgb(self, libsecam_image_row(image, 0, y), \
+            bpp, ri, gi, bi, luma, cb, cr); \
+    } \
+    static double libsecam_level_##name(libsecam_t const *self, \
+        libsecam_image_t const *image, int y) \
+    { \
+        return libsecam_level_rgb(self, libsecam_image_row(image, 0, y), \
+            bpp, gi); \
+    }
+
+LIBSECAM_DEFINE_RGB_FORMAT(xrgb, 4, 0, 1, 2)
+LIBSECAM_DEFINE_RGB_FORMAT(xbgr, 4, 2, 1, 0)
+LIBSECAM_DEFINE_RGB_FORMAT(rgb24, 3, 0, 1, 2)
+LIBSECAM_DEFINE_RGB_FORMAT(bgr24, 3, 2, 1, 0)
+
 /**
- * Apply effects to luminance.
+ * Unpack 16-bit RGBA line to YCbCr.
  */
-static void libsecam_filter_luma(libsecam_t *self, int *luma, int *osci)
+LIBSECAM_KERNEL static void libsecam_unpack_rgba64(libsecam_t const *self,
+    libsecam_image_t const *image, int y,
+    unsigned char *luma, signed char *cb, signed char *cr)
 {
-    double noise = self->options.luma_noise;
-    int echo = self->options.echo;
+    unsigned short const *src = (unsigned short const *) libsecam_image_row(image, 0, y);
+
+    for (int x = 0; x < self->width; x++) {
+        double r = src[4 * x + 0] / 65535.0;
+        double g = src[4 * x + 1] / 65535.0;
+        double b = src[4 * x + 2] / 65535.0;
+
+        luma[x] = (int) (LIBSECAM_RGB_TO_Y(r, g, b));
+        cb[x] = (int) (LIBSECAM_RGB_TO_CB(r, g, b));
+        cr[x] = (int) (LIBSECAM_RGB_TO_CR(r, g, b));
+    }
+}
 
-    int prev = luma[0];
+/**
+ * Pack YCbCr line to 16-bit RGBA.
+ * Conversion to RGB isn't rounded to 8 bits on the way.
+ */
+LIBSECAM_KERNEL static void libsecam_pack_rgba64(libsecam_t const *self,
+    libsecam_image_t const *image, int y,
+    int const *luma, int const *cb, int const *cr)
+{
+    unsigned short *dst = (unsigned short *) libsecam_image_row(image, 0, y);
 
     for (int x = 0; x < self->width; x++) {
-        // Apply echo.
-        if (echo) {
-            double u = luma[LIBSECAM_CLAMP(x - echo, 0, self->width)];
-            double v = luma[x];
-            luma[x] = v - (u * 0.5) + (v * 0.5);
-        }
+        int r = 257.0 * (LIBSECAM_YCBCR_TO_R(luma[x], 128 + cb[x], 128 + cr[x]));
+        int g = 257.0 * (LIBSECAM_YCBCR_TO_G(luma[x], 128 + cb[x], 128 + cr[x]));
+        int b = 257.0 * (LIBSECAM_YCBCR_TO_B(luma[x], 128 + cb[x], 128 + cr[x]));
+
+        dst[4 * x + 0] = LIBSECAM_CLAMP(r, 0, 65535);
+        dst[4 * x + 1] = LIBSECAM_CLAMP(g, 0, 65535);
+        dst[4 * x + 2] = LIBSECAM_CLAMP(b, 0, 65535);
+        dst[4 * x + 3] = 65535;
+    }
+}
 
-        // Apply noise.
-        luma[x] += noise * ((libsecam_fastrand() % 255) - 128);
+static double libsecam_level_rgba64(libsecam_t const *self,
+    libsecam_image_t const *image, int y)
+{
+    unsigned short const *src = (unsigned short const *) libsecam_image_row(image, 0, y);
+    long long brightness = 0;
+
+    for (int x = 0; x < self->width; x++) {
+        brightness += src[4 * x + 1];
+    }
 
-        // Need to clamp luminance to prevent fire from going crazy.
-        luma[x] = LIBSECAM_CLAMP(luma[x], 0, 255);
+    return brightness / self->width / 65535.0;
+}
 
-        // Calculate oscillation.
-        osci[x] = abs(luma[x] - prev);
-        prev = luma[x];
+/**
+ * Bring float sample to 0.0 to 1.0, NaN becomes 0.0.
+ */
+static inline double libsecam_unit(float value)
+{
+    if (!(value > 0.0f)) {
+        return 0.0;
     }
+
+    return (value < 1.0f) ? value : 1.0;
 }
 
 /**
- * Apply effects to chrominance.
+ * Unpack float RGBA line to YCbCr.
+ * Values out of 0.0 to 1.0 are clipped.
  */
-static void libsecam_filter_chroma(libsecam_t *self, int *cu, int *cv,
-    int const *osci)
+LIBSECAM_KERNEL static void libsecam_unpack_rgba32f(libsecam_t const *self,
+    libsecam_image_t const *image, int y,
+    unsigned char *luma, signed char *cb, signed char *cr)
 {
-    double noise = self->options.chroma_noise;
-    double fire = self->options.chroma_fire;
+    float const *src = (float const *) libsecam_image_row(image, 0, y);
 
-    int threshold = 48;
+    for (int x = 0; x < self->width; x++) {
+        double r = libsecam_unit(src[4 * x + 0]);
+        double g = libsecam_unit(src[4 * x + 1]);
+        double b = libsecam_unit(src[4 * x + 2]);
+
+        luma[x] = (int) (LIBSECAM_RGB_TO_Y(r, g, b));
+        cb[x] = (int) (LIBSECAM_RGB_TO_CB(r, g, b));
+        cr[x] = (int) (LIBSECAM_RGB_TO_CR(r, g, b));
+    }
+}
 
-    int gain = 0;
-    int fall = 2560 / self->width;
-    int sign = -1;
+/**
+ * Pack YCbCr line to float RGBA.
+ */
+LIBSECAM_KERNEL static void libsecam_pack_rgba32f(libsecam_t const *self,
+    libsecam_image_t const *image, int y,
+    int const *luma, int const *cb, int const *cr)
+{
+    float *dst = (float *) libsecam_image_row(image, 0, y);
 
     for (int x = 0; x < self->width; x++) {
-        if (gain > 0) {
-            cu[x] += gain * sign;
-            gain -= fall;
-        } else {
-            double r = libsecam_fastrand() / 32768.0;
+        double r = (LIBSECAM_YCBCR_TO_R(luma[x], 128 + cb[x], 128 + cr[x])) / 255.0;
+        double g = (LIBSECAM_YCBCR_TO_G(luma[x], 128 + cb[x], 128 + cr[x])) / 255.0;
+        double b = (LIBSECAM_YCBCR_TO_B(luma[x], 128 + cb[x], 128 + cr[x])) / 255.0;
+
+        dst[4 * x + 0] = (float) (LIBSECAM_CLAMP(r, 0.0, 1.0));
+        dst[4 * x + 1] = (float) (LIBSECAM_CLAMP(g, 0.0, 1.0));
+        dst[4 * x + 2] = (float) (LIBSECAM_CLAMP(b, 0.0, 1.0));
+        dst[4 * x + 3] = 1.0f;
+    }
+}
 
-            if (r < (fire / 20.0)) {
-                int u = osci[x] / 2;
-                int v = abs(cu[x] - cv[x]) / 2;
+static double libsecam_level_rgba32f(libsecam_t const *self,
+    libsecam_image_t const *image, int y)
+{
+    float const *src = (float const *) libsecam_image_row(image, 0, y);
+    double brightness = 0.0;
 
-                if ((u + v) > threshold) {
-                    gain = 128 + (libsecam_fastrand() % 128);
-                    sign = (cu[x] > 64) ? -1 : +1;
-                }
-            }
-        }
+    for (int x = 0; x < self->width; x++) {
+        brightness += libsecam_unit(src[4 * x + 1]);
+    }
+
+    return brightness / self->width;
+}
+
+/**
+ * Unpack planar YCbCr line.
+ * Planes are limited range BT.601 like the filter itself,
+ * so there's nothing to convert, chroma is just upsampled.
+ */
+static inline void libsecam_unpack_yuv(libsecam_t const *self,
+    libsecam_image_t const *image, int y, int hshift, int vshift,
+    unsigned char *luma, signed char *cb, signed char *cr)
+{
+    unsigned char const *src_y = libsecam_image_row(image, 0, y);
+    unsigned char const *src_u = libsecam_image_row(image, 1, y >> vshift);
+    unsigned char const *src_v = libsecam_image_row(image, 2, y >> vshift);
+
+    memcpy(luma, src_y, self->width);
 
-        cu[x] += noise * ((libsecam_fastrand() % 512) - 256);
+    for (int x = 0; x < self->width; x++) {
+        cb[x] = src_u[x >> hshift] - 128;
+        cr[x] = src_v[x >> hshift] - 128;
     }
 }
 
 /**
- * Filter the whole frame or part of it.
+ * Pack YCbCr line to planes.
+ * Of the rows sharing chroma, only the first one writes it,
+ * so bands never write the same chroma row.
  */
-static void libsecam_perform(libsecam_t *self, int job, int y0, int y1, unsigned char const *src, unsigned char *dst)
+static inline void libsecam_pack_yuv(libsecam_t const *self,
+    libsecam_image_t const *image, int y, int hshift, int vshift,
+    int const *luma, int const *cb, int const *cr)
 {
-    int *luma = self->luma[job];
-    int *osci = self->osci[job];
-    int *cb = self->cb[job];
-    int *cr = self->cr[job];
-    int *cx = self->cx[job];
+    unsigned char *dst_y = libsecam_image_row(image, 0, y);
 
-    if (y0 == 0) {
-        memset(cx, 0, sizeof(*cx) * self->width);
-    } else {
-        libsecam_convert_line(self, &src[self->width * 4 * (y0 - 1)],
-            luma, cb, cr, y0);
-        memcpy(cx, cr, sizeof(*cx) * self->width);
+    for (int x = 0; x < self->width; x++) {
+        dst_y[x] = LIBSECAM_CLAMP(luma[x], 0, 255);
     }
 
-    for (int y = y0; y < y1; y++) {
-        size_t row = self->width * 4 * y;
+    if (y & ((1 << vshift) - 1)) {
+        return;
+    }
 
-        libsecam_convert_line(self, &src[row], luma, cb, cr, y);
-        libsecam_filter_luma(self, luma, osci);
+    unsigned char *dst_u = libsecam_image_row(image, 1, y >> vshift);
+    unsigned char *dst_v = libsecam_image_row(image, 2, y >> vshift);
 
-        if ((y % 2) == 0) {
-            libsecam_filter_chroma(self, cb, cr, osci);
-            libsecam_revert_line(self, &dst[row], luma, cb, cx);
-            memcpy(cx, cb, sizeof(*cx) * self->width);
-        } else {
-            libsecam_filter_chroma(self, cr, cb, osci);
-            libsecam_revert_line(self, &dst[row], luma, cx, cr);
-            memcpy(cx, cr, sizeof(*cx) * self->width);
+    int n = 1 << hshift;
+
+    for (int i = 0; i < (self->width >> hshift); i++) {
+        int u = 0;
+        int v = 0;
+
+        for (int j = 0; j < n; j++) {
+            u += cb[(i << hshift) + j];
+            v += cr[(i << hshift) + j];
         }
+
+        u = 128 + u / n;
+        v = 128 + v / n;
+
+        dst_u[i] = LIBSECAM_CLAMP(u, 0, 255);
+        dst_v[i] = LIBSECAM_CLAMP(v, 0, 255);
     }
 }
 
-#ifdef LIBSECAM_USE_THREADS
-
-#ifdef _WIN32
-static DWORD WINAPI libsecam_job_main(LPVOID context)
-#else
-static void *libsecam_job_main(void *context)
-#endif
+/**
+ * Measure brightness of planar line, only luma is needed.
+ */
+static inline double libsecam_level_yuv(libsecam_t const *self,
+    libsecam_image_t const *image, int y)
 {
-    struct libsecam_job *job = context;
+    unsigned char const *src = libsecam_image_row(image, 0, y);
+    int brightness = 0;
 
-    libsecam_perform(job->self, job->id,
-        job->y0, job->y1,
-        job->src, job->dst);
+    for (int x = 0; x < self->width; x++) {
+        brightness += src[x];
+    }
 
-    return 0;
+    return brightness / self->width / 255.0;
 }
 
-#endif // LIBSECAM_USE_THREADS
+#define LIBSECAM_DEFINE_YUV_FORMAT(name, hshift, vshift) \
+    LIBSECAM_KERNEL static void libsecam_unpack_##name(libsecam_t const *self, \
+        libsecam_image_t const *image, int y, \
+        unsigned char *luma, signed char *cb, signed char *cr) \
+    { \
+        libsecam_unpack_yuv(self, image, y, hshift, vshift, luma, cb, cr); \
+    } \
+    LIBSECAM_KERNEL static void libsecam_pack_##name(libsecam_t const *self, \
+        libsecam_image_t const *image, int y, \
+        int const *luma, int const *cb, int const *cr) \
+    { \
+        libsecam_pack_yuv(self, image, y, hshift, vshift, luma, cb, cr); \
+    }
 
-//------------------------------------------------------------------------------
+LIBSECAM_DEFINE_YUV_FORMAT(yuv420p, 1, 1)
+LIBSECAM_DEFINE_YUV_FORMAT(yuv444p, 0, 0)
 
-libsecam_t *libsecam_init(int width, int height)
+/**
+ * Unpack P010 line, only the high 8 bits of samples are used.
+ */
+LIBSECAM_KERNEL static void libsecam_unpack_p010(libsecam_t const *self,
+    libsecam_image_t const *image, int y,
+    unsigned char *luma, signed char *cb, signed char *cr)
 {
-    libsecam_t *self = LIBSECAM_MALLOC(sizeof(libsecam_t));
+    unsigned short const *src_y = (unsigned short const *) libsecam_image_row(image, 0, y);
+    unsigned short const *src_uv = (unsigned short const *) libsecam_image_row(image, 1, y >> 1);
 
-    if (!self) {
-        return NULL;
+    for (int x = 0; x < self->width; x++) {
+        luma[x] = src_y[x] >> 8;
+        cb[x] = (src_uv[(x >> 1) * 2 + 0] >> 8) - 128;
+        cr[x] = (src_uv[(x >> 1) * 2 + 1] >> 8) - 128;
     }
+}
 
-    memset(self, 0, sizeof(*self));
-
-    self->options.luma_noise = LIBSECAM_DEFAULT_LUMA_NOISE;
-    self->options.chroma_noise = LIBSECAM_DEFAULT_CHROMA_NOISE;
-    self->options.chroma_fire = LIBSECAM_DEFAULT_CHROMA_FIRE;
-    self->options.echo = LIBSECAM_DEFAULT_ECHO;
-    self->options.skew = LIBSECAM_DEFAULT_SKEW;
-    self->options.wobble = LIBSECAM_DEFAULT_WOBBLE;
+/**
+ * Pack P010 line, same as planar 4:2:0 but with 16-bit samples.
+ * Averaged chroma keeps its fraction in the low bits.
+ */
+LIBSECAM_KERNEL static void libsecam_pack_p010(libsecam_t const *self,
+    libsecam_image_t const *image, int y,
+    int const *luma, int const *cb, int const *cr)
+{
+    unsigned short *dst_y = (unsigned short *) libsecam_image_row(image, 0, y);
 
-    self->width = width;
-    self->height = height;
+    for (int x = 0; x < self->width; x++) {
+        int v = LIBSECAM_CLAMP(luma[x], 0, 255);
+        dst_y[x] = (unsigned short) (v << 8);
+    }
 
-    for (int i = 0; i < LIBSECAM_NUM_THREADS; i++) {
-        self->luma[i] = LIBSECAM_MALLOC(sizeof(*self->luma) * self->width);
-        self->osci[i] = LIBSECAM_MALLOC(sizeof(*self->osci) * self->width);
-        self->cb[i] = LIBSECAM_MALLOC(sizeof(*self->cb) * self->width);
-        self->cr[i] = LIBSECAM_MALLOC(sizeof(*self->cr) * self->width);
-        self->cx[i] = LIBSECAM_MALLOC(sizeof(*self->cx) * self->width);
+    if (y & 1) {
+        return;
     }
 
-    self->vertical_noise = LIBSECAM_MALLOC(sizeof(*self->vertical_noise) * self->height);
-    self->vertical_level = LIBSECAM_MALLOC(sizeof(*self->vertical_level) * self->height);
+    unsigned short *dst_uv = (unsigned short *) libsecam_image_row(image, 1, y >> 1);
 
-    self->output = NULL; // Will be initialized later if used.
-    self->frame_count = 0;
+    for (int i = 0; i < (self->width >> 1); i++) {
+        int u = (128 << 8) + (cb[2 * i] + cb[2 * i + 1]) * 128;
+        int v = (128 << 8) + (cr[2 * i] + cr[2 * i + 1]) * 128;
 
-    return self;
+        dst_uv[2 * i + 0] = (LIBSECAM_CLAMP(u, 0, 65535)) & 0xffc0;
+        dst_uv[2 * i + 1] = (LIBSECAM_CLAMP(v, 0, 65535)) & 0xffc0;
+    }
 }
 
-void libsecam_close(libsecam_t *self)
+static double libsecam_level_p010(libsecam_t const *self,
+    libsecam_image_t const *image, int y)
 {
-    LIBSECAM_FREE(self->vertical_noise);
-    LIBSECAM_FREE(self->vertical_level);
+    unsigned short const *src = (unsigned short const *) libsecam_image_row(image, 0, y);
+    long long brightness = 0;
 
-    for (int i = 0; i < LIBSECAM_NUM_THREADS; i++) {
-        LIBSECAM_FREE(self->luma[i]);
-        LIBSECAM_FREE(self->osci[i]);
-        LIBSECAM_FREE(self->cb[i]);
-        LIBSECAM_FREE(self->cr[i]);
-        LIBSECAM_FREE(self->cx[i]);
+    for (int x = 0; x < self->width; x++) {
+        brightness += src[x];
     }
 
-    LIBSECAM_FREE(self->output);
-    LIBSECAM_FREE(self);
+    return brightness / self->width / 65535.0;
 }
 
-libsecam_options_t *libsecam_options(libsecam_t *self)
+static struct libsecam_format_info const libsecam_formats[LIBSECAM_TOTAL_FORMATS] = {
+    { 1, { 4 }, { 0 }, { 0 }, libsecam_unpack_xrgb, libsecam_pack_xrgb, libsecam_level_xrgb },
+    { 1, { 4 }, { 0 }, { 0 }, libsecam_unpack_xbgr, libsecam_pack_xbgr, libsecam_level_xbgr },
+    { 1, { 3 }, { 0 }, { 0 }, libsecam_unpack_rgb24, libsecam_pack_rgb24, libsecam_level_rgb24 },
+    { 1, { 3 }, { 0 }, { 0 }, libsecam_unpack_bgr24, libsecam_pack_bgr24, libsecam_level_bgr24 },
+    { 3, { 1, 1, 1 }, { 0, 1, 1 }, { 0, 1, 1 }, libsecam_unpack_yuv420p, libsecam_pack_yuv420p, libsecam_level_yuv },
+    { 3, { 1, 1, 1 }, { 0, 0, 0 }, { 0, 0, 0 }, libsecam_unpack_yuv444p, libsecam_pack_yuv444p, libsecam_level_yuv },
+    { 1, { 8 }, { 0 }, { 0 }, libsecam_unpack_rgba64, libsecam_pack_rgba64, libsecam_level_rgba64 },
+    { 2, { 2, 4 }, { 0, 1 }, { 0, 1 }, libsecam_unpack_p010, libsecam_pack_p010, libsecam_level_p010 },
+    { 1, { 16 }, { 0 }, { 0 }, libsecam_unpack_rgba32f, libsecam_pack_rgba32f, libsecam_level_rgba32f },
+};
+
+// Widest pixel of one-plane formats (RGBA32F), for packed line buffers.
+#define LIBSECAM_MAX_PIXEL_SIZE     16
+
+/**
+ * Hash bytes, used to detect unchanged rows.
+ */
+static unsigned long long libsecam_hash_bytes(unsigned long long hash,
+    unsigned char const *src, int length)
 {
-    return &self->options;
+    int x = 0;
+
+    for (; x + 8 <= length; x += 8) {
+        unsigned long long word;
+        memcpy(&word, &src[x], sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+    }
+
+    for (; x < length; x++) {
+        hash = (hash ^ src[x]) * 0x100000001b3ull;
+    }
+
+    return hash;
 }
 
-void libsecam_filter_to_buffer(libsecam_t *self, unsigned char const *src, unsigned char *dst)
+/**
+ * Hash all planes of image row.
+ */
+static unsigned long long libsecam_hash_line(libsecam_t const *self,
+    libsecam_image_t const *image, int y)
 {
-    // Calculate loss values.
-    // Target for 240 TVL for luminance and 60 TVL for chrominance.
+    struct libsecam_format_info const *info = &libsecam_formats[image->format];
+    unsigned long long hash = 0xcbf29ce484222325ull;
 
-    self->luma_loss = 1;
-    self->chroma_loss = 1;
+    for (int i = 0; i < info->num_planes; i++) {
+        int length = (self->width >> info->hshift[i]) * info->bytes_per_pixel[i];
+        unsigned char const *row = libsecam_image_row(image, i, y >> info->vshift[i]);
 
-    while (self->luma_loss <= (self->width / 240)) {
-        self->luma_loss *= 2;
+        hash = libsecam_hash_bytes(hash, row, length);
     }
 
-    while (self->chroma_loss <= (self->width / 60)) {
-        self->chroma_loss *= 2;
+    return hash;
+}
+
+//------------------------------------------------------------------------------
+
+/**
+ * Get unpacked line, either from the cache or by unpacking it
+ * into per-thread buffers.
+ * If `shared` is false, the line is being read by a thread which doesn't
+ * own it, so it's not allowed to be written to the cache.
+ */
+static void libsecam_fetch_line(libsecam_t *self, struct libsecam_scratch_s *scratch,
+    libsecam_image_t const *src, int y, bool shared,
+    unsigned char **luma, signed char **cb, signed char **cr)
+{
+    libsecam_unpack_func_t unpack = libsecam_formats[src->format].unpack;
+
+    if (self->options.static_cache && self->cached_luma) {
+        size_t offset = (size_t) self->width * y;
+
+        if (!self->row_dirty[y]) {
+            *luma = &self->cached_luma[offset];
+            *cb = &self->cached_cb[offset];
+            *cr = &self->cached_cr[offset];
+            return;
+        }
+
+        if (shared) {
+            *luma = &self->cached_luma[offset];
+            *cb = &self->cached_cb[offset];
+            *cr = &self->cached_cr[offset];
+            unpack(self, src, y, *luma, *cb, *cr);
+            return;
+        }
     }
 
-    int step = self->height / 64;
+    *luma = scratch->row_luma;
+    *cb = scratch->row_cb;
+    *cr = scratch->row_cr;
 
-    for (int y = 0; y < self->height; y += step) {
-        self->vertical_noise[y] = libsecam_fastrand() / 32768.0;
+    unpack(self, src, y, *luma, *cb, *cr);
+}
+
+/**
+ * Convert unpacked line to filter buffers.
+ */
+LIBSECAM_KERNEL static void libsecam_convert_line(libsecam_t *self, unsigned char const *row_luma,
+    signed char const *row_cb, signed char const *row_cr,
+    int *luma, int *cb, int *cr, int y)
+{
+    int shift = 0;
+
+    if (self->options.wobble) {
+        shift += self->vertical_noise[y] * self->options.wobble;
+    }
+
+    if (self->options.skew) {
+        shift += self->vertical_level[y] * self->options.skew;
     }
 
-    // Measure brightness real quick.
+    int step = self->chroma_step;
 
-    for (int y = 0; y < self->height; y++) {
-        int brightness = 0;
+    for (int i = 0; i < self->chroma_width; i++) {
+        int x0 = i * step;
+        int x1 = (x0 + step < self->width) ? (x0 + step) : self->width;
 
-        for (int x = 0; x < self->width; x++) {
-            int green = src[self->width * 4 * y + 4 * x + 1];
-            brightness += green;
+        int cb_sum = 0;
+        int cr_sum = 0;
+
+        for (int x = x0; x < x1; x++) {
+            int n = x - shift;
+
+            if (n >= 0 && n < self->width) {
+                luma[x] = row_luma[n];
+                cb_sum += row_cb[n];
+                cr_sum += row_cr[n];
+            } else {
+                luma[x] = 16; // black
+            }
         }
 
-        self->vertical_level[y] = brightness / self->width / 255.0;
+        // Chroma is stored as an average of the cell.
+        cb[i] = cb_sum / (x1 - x0);
+        cr[i] = cr_sum / (x1 - x0);
     }
+}
 
-    for (int y = 0; y < self->height; y += step) {
-        for (int j = 1; j < step; j++) {
-            self->vertical_level[y] += self->vertical_level[y + 1];
-        }
+/**
+ * Apply luminance and chrominance loss, producing full resolution line.
+ * Chroma loss is a running average over chroma_loss / chroma_step samples,
+ * interpolated between neighbouring samples to avoid blocky edges.
+ */
+LIBSECAM_KERNEL static void libsecam_revert_line(libsecam_t *self, int const *luma,
+    int const *cb, int const *cr, int *out_luma, int *out_cb, int *out_cr)
+{
+    int luma_loss = self->luma_loss;
 
-        self->vertical_level[y] /= (double) step;
+    if (self->governor.quality >= LIBSECAM_QUALITY_SHORT_LOSS && luma_loss > 1) {
+        luma_loss /= 2;
     }
 
-    libsecam_lerp_line(self->vertical_noise, self->height, step);
-    libsecam_lerp_line(self->vertical_level, self->height, step);
+    double luma_factor = 1.0 / luma_loss;
 
-#ifndef LIBSECAM_USE_THREADS
-    libsecam_perform(self, 0, 0, self->height, src, dst);
-#else
-    struct libsecam_job jobs[LIBSECAM_NUM_THREADS];
+    int step = self->chroma_step;
+    int taps = self->chroma_loss / step;
 
-    int chunk_height = self->height / LIBSECAM_NUM_THREADS;
+    int cb_sum = 0;
+    int cr_sum = 0;
+    int cb_prev = 0;
+    int cr_prev = 0;
 
-    // Start threads to process frame chunks separately.
-    for (int i = 0; i < LIBSECAM_NUM_THREADS; i++) {
-        jobs[i].self = self;
-        jobs[i].id = i;
-        jobs[i].y0 = chunk_height * (i + 0);
-        jobs[i].y1 = chunk_height * (i + 1);
-        jobs[i].src = src;
-        jobs[i].dst = dst;
+    for (int i = 0; i < self->chroma_width; i++) {
+        cb_sum += cb[i];
+        cr_sum += cr[i];
 
-        libsecam_create_thread(&jobs[i].thread, libsecam_job_main, &jobs[i]);
-    }
+        if (i >= taps) {
+            cb_sum -= cb[i - taps];
+            cr_sum -= cr[i - taps];
+        }
+
+        int cb_next = cb_sum / taps;
+        int cr_next = cr_sum / taps;
+
+        int x0 = i * step;
+        int x1 = (x0 + step < self->width) ? (x0 + step) : self->width;
+
+        for (int x = x0; x < x1; x++) {
+            int y_val = 0;
+            int cb_val = cb_prev + (cb_next - cb_prev) * (x - x0 + 1) / step;
+            int cr_val = cr_prev + (cr_next - cr_prev) * (x - x0 + 1) / step;
+
+            for (int j = 0; j < luma_loss; j++) {
+                int n = x - j;
+
+                if (n >= 0 && n < self->width) {
+                    y_val += luma_factor * luma[n];
+                }
+            }
+
+            out_luma[x] = y_val;
+            out_cb[x] = cb_val;
+            out_cr[x] = cr_val;
+        }
 
-    // Wait until all jobs are done.
-    for (int i = 0; i < LIBSECAM_NUM_THREADS; i++) {
-        libsecam_wait_thread(jobs[i].thread);
+        cb_prev = cb_next;
+        cr_prev = cr_next;
     }
-#endif // LIBSECAM_USE_THREADS
 }
 
-unsigned char const *libsecam_filter(libsecam_t *self, unsigned char const *src)
+/**
+ * Delay half of the luminance signal, add noise and clamp.
+ */
+static inline int libsecam_echo_pixel(int v, int u, int noise)
 {
-    if (!self->output) {
-        self->output = LIBSECAM_MALLOC(self->width * self->height * 4);
+    v = (3 * v - u) / 2 + noise;
 
-        if (!self->output) {
-            return NULL;
+    // Need to clamp luminance to prevent fire from going crazy.
+    return LIBSECAM_CLAMP(v, 0, 255);
+}
+
+/**
+ * Apply effects to luminance.
+ * Noise of the whole line is laid out first, so the rest doesn't call the
+ * random number generator. Every pixel echoes the one echo pixels behind it,
+ * which is already final, so the echo loop vectorises in runs of echo pixels
+ * (when echo is at least the vector width). Pixels closer than that to the
+ * line edges echo the edge pixel. Oscillation is found in a separate pass.
+ */
+LIBSECAM_KERNEL static void libsecam_filter_luma(libsecam_t *self, struct libsecam_scratch_s *scratch,
+    int *luma, int *osci)
+{
+    int width = self->width;
+    int echo = self->options.echo;
+    int *work = scratch->luma_work;
+
+    if (self->governor.quality >= LIBSECAM_QUALITY_FAST_NOISE) {
+        echo = 0;
+    }
+
+    if (libsecam_fast_noise(self)) {
+        short const *atlas = &self->luma_atlas.noise[libsecam_atlas_offset(&scratch->rng,
+            self->luma_atlas.size)];
+
+        for (int x = 0; x < width; x++) {
+            work[x] = atlas[x];
+        }
+    } else {
+        for (int x = 0; x < width; x++) {
+            work[x] = scratch->luma_noise[libsecam_fastrand(&scratch->rng) % 255];
         }
     }
 
-    libsecam_filter_to_buffer(self, src, self->output);
+    int first = luma[0];
 
-    return self->output;
-}
+    if (echo == 0) {
+        for (int x = 0; x < width; x++) {
+            int v = luma[x] + work[x];
+            luma[x] = LIBSECAM_CLAMP(v, 0, 255);
+        }
+    } else {
+        int head = (echo > 0) ? ((echo < width) ? echo : width) : 0;
+        int tail = (echo > 0) ? width : ((width + echo > 0) ? (width + echo) : 0);
+
+        for (int x = 0; x < head; x++) {
+            luma[x] = libsecam_echo_pixel(luma[x], luma[0], work[x]);
+        }
+
+        for (int x = head; x < tail; x++) {
+            luma[x] = libsecam_echo_pixel(luma[x], luma[x - echo], work[x]);
+        }
+
+        for (int x = tail; x < width; x++) {
+            luma[x] = libsecam_echo_pixel(luma[x], luma[width - 1], work[x]);
+        }
+    }
+
+    // Calculate oscillation, chroma only needs the strongest one per sample.
+    work[0] = abs(luma[0] - first);
+
+    for (int x = 1; x < width; x++) {
+        work[x] = abs(luma[x] - luma[x - 1]);
+    }
+
+    int step = self->chroma_step;
+
+    for (int i = 0; i < self->chroma_width; i++) {
+        int x0 = i * step;
+        int x1 = (x0 + step < width) ? (x0 + step) : width;
+        int o = 0;
+
+        for (int x = x0; x < x1; x++) {
+            o = (work[x] > o) ? work[x] : o;
+        }
+
+        osci[i] = o;
+    }
+}
+
+/**
+ * Apply chroma noise and fire.
+ * Fire can start only outside of other fire, so candidates are found for the
+ * whole line first, which is cheap, and then the rare real ones are applied.
+ * Random number of each sample is split into fire chance (bits 0-14),
+ * fire gain (16-22) and noise (23-31).
+ */
+LIBSECAM_KERNEL static void libsecam_filter_chroma(libsecam_t *self, struct libsecam_scratch_s *scratch,
+    int *cu, int const *cv, int const *osci)
+{
+    int step = self->chroma_step;
+    int width = self->chroma_width;
+
+    double noise = self->options.chroma_noise / sqrt(step);
+    double fire = 1.0 - pow(1.0 - self->options.chroma_fire / 20.0, step);
+
+    int threshold = 48;
+    int chance = (int) ceil(fire * 32768.0);
+
+    int fall = (2560 * step) / self->width;
+
+    if (fall < 1) {
+        fall = 1;
+    }
+
+    unsigned int *rand = scratch->chroma_rand;
+    unsigned char *mask = scratch->fire_mask;
+    int *list = scratch->fire_list;
+
+    unsigned int key = (libsecam_fastrand(&scratch->rng) << 15)
+        ^ libsecam_fastrand(&scratch->rng);
+
+    // Find samples where fire may start.
+    for (int x = 0; x < width; x++) {
+        unsigned int r = libsecam_hash_position(key, x);
+        int u = osci[x] / 2;
+        int v = abs(cu[x] - cv[x]) / 2;
+
+        rand[x] = r;
+        mask[x] = ((int) (r & 0x7fff) < chance) & ((u + v) > threshold);
+    }
+
+    int count = 0;
+
+    for (int x = 0; x < width; x++) {
+        list[count] = x;
+        count += mask[x];
+    }
+
+    // Fire lasts while its gain is positive, candidates inside of it
+    // are ignored.
+    int next = 0;
+
+    for (int i = 0; i < count; i++) {
+        int x = list[i];
+
+        if (x < next) {
+            continue;
+        }
+
+        int gain = 128 + ((rand[x] >> 16) & 127);
+        int sign = (cu[x] > 64) ? -1 : +1;
+
+        for (next = x + 1; next < width && gain > 0; next++) {
+            cu[next] += gain * sign;
+            gain -= fall;
+        }
+    }
+
+    if (libsecam_fast_noise(self)) {
+        short const *atlas = &self->chroma_atlas.noise[libsecam_atlas_offset(&scratch->rng,
+            self->chroma_atlas.size)];
+
+        for (int x = 0; x < width; x++) {
+            cu[x] += atlas[x];
+        }
+    } else {
+        for (int x = 0; x < width; x++) {
+            cu[x] += noise * ((int) (rand[x] >> 23) - 256);
+        }
+    }
+}
+
+/**
+ * Reset the band state before its first line.
+ */
+static void libsecam_start_band(libsecam_t *self, struct libsecam_scratch_s *scratch,
+    libsecam_image_t const *src, int y0)
+{
+    scratch->rng = libsecam_mix_seed(self->seed, self->frame_count, y0);
+    scratch->phase = y0 % 2;
+
+    // Rounded down, as adding noise to non-negative luma does. Adding
+    // it to luma also hides rounding errors, e.g. 0.07 * -100 is slightly
+    // less than -7, hence the bias.
+    for (int i = 0; i < 255; i++) {
+        scratch->luma_noise[i] = (int) floor(self->options.luma_noise * (i - 128) + 1e-9);
+    }
+
+    if (y0 == 0) {
+        memset(scratch->cx, 0, sizeof(*scratch->cx) * self->chroma_width);
+    } else {
+        unsigned char *row_luma;
+        signed char *row_cb;
+        signed char *row_cr;
+
+        libsecam_fetch_line(self, scratch, src, y0 - 1, false,
+            &row_luma, &row_cb, &row_cr);
+        libsecam_convert_line(self, row_luma, row_cb, row_cr,
+            scratch->luma, scratch->cb, scratch->cr, y0);
+        memcpy(scratch->cx, scratch->cr, sizeof(*scratch->cx) * self->chroma_width);
+    }
+}
+
+/**
+ * Filter one unpacked line, result goes to scratch output buffers.
+ * Chroma alternates with every line filtered, which is every line of
+ * the band unless the governor skips some of them.
+ */
+static void libsecam_process_line(libsecam_t *self, struct libsecam_scratch_s *scratch,
+    unsigned char const *row_luma, signed char const *row_cb,
+    signed char const *row_cr, int y)
+{
+    int *luma = scratch->luma;
+    int *osci = scratch->osci;
+    int *cb = scratch->cb;
+    int *cr = scratch->cr;
+    int *cx = scratch->cx;
+
+    LIBSECAM_TRACE_BEGIN(convert_start);
+    libsecam_convert_line(self, row_luma, row_cb, row_cr, luma, cb, cr, y);
+    LIBSECAM_TRACE_END(convert_start, "convert", self->frame_count, "row", y);
+
+    LIBSECAM_TRACE_BEGIN(luma_start);
+    libsecam_filter_luma(self, scratch, luma, osci);
+    LIBSECAM_TRACE_END(luma_start, "luma", self->frame_count, "row", y);
+
+    // Chroma lines alternate, the other one comes from the previous line.
+    int *cu = (scratch->phase == 0) ? cb : cr;
+    int *cv = (scratch->phase == 0) ? cr : cb;
+
+    LIBSECAM_TRACE_BEGIN(chroma_start);
+    libsecam_filter_chroma(self, scratch, cu, cv, osci);
+    LIBSECAM_TRACE_END(chroma_start, "chroma", self->frame_count, "row", y);
+
+    LIBSECAM_TRACE_BEGIN(revert_start);
+
+    if (scratch->phase == 0) {
+        libsecam_revert_line(self, luma, cb, cx,
+            scratch->out_luma, scratch->out_cb, scratch->out_cr);
+    } else {
+        libsecam_revert_line(self, luma, cx, cr,
+            scratch->out_luma, scratch->out_cb, scratch->out_cr);
+    }
+
+    memcpy(cx, cu, sizeof(*cx) * self->chroma_width);
+    scratch->phase ^= 1;
+
+    LIBSECAM_TRACE_END(revert_start, "revert", self->frame_count, "row", y);
+}
+
+/**
+ * Whether the output frame should be written past the cache.
+ */
+static bool libsecam_use_nontemporal(libsecam_t const *self, libsecam_image_t const *dst)
+{
+#ifdef LIBSECAM_HAS_NONTEMPORAL
+    struct libsecam_format_info const *format = &libsecam_formats[dst->format];
+    size_t size = (size_t) self->width * self->height * format->bytes_per_pixel[0];
+
+    return format->num_planes == 1 && size > self->nontemporal_threshold;
+#else
+    (void) self;
+    (void) dst;
+    return false;
+#endif
+}
+
+#ifdef LIBSECAM_HAS_NONTEMPORAL
+
+/**
+ * Copy bytes with non-temporal stores. Partial 16-byte blocks at the ends
+ * go through the cache.
+ */
+static void libsecam_stream_copy(unsigned char *dst, unsigned char const *src, size_t size)
+{
+    size_t head = (16 - ((size_t) dst & 15)) & 15;
+
+    if (head > size) {
+        head = size;
+    }
+
+    memcpy(dst, src, head);
+
+    size_t x = head;
+
+    for (; x + 16 <= size; x += 16) {
+        __m128i block = _mm_loadu_si128((__m128i const *) &src[x]);
+        _mm_stream_si128((__m128i *) &dst[x], block);
+    }
+
+    memcpy(&dst[x], &src[x], size - x);
+}
+
+#endif
+
+/**
+ * Pack filtered line to the output row, or to the line buffer first,
+ * which stays in L1, and then stream it out in whole.
+ */
+static void libsecam_pack_line(libsecam_t const *self, struct libsecam_scratch_s *scratch,
+    libsecam_pack_func_t pack, libsecam_image_t const *dst, int y, bool nontemporal)
+{
+#ifdef LIBSECAM_HAS_NONTEMPORAL
+    if (nontemporal) {
+        libsecam_image_t line = *dst;
+
+        line.planes[0] = scratch->out_row;
+        pack(self, &line, 0, scratch->out_luma, scratch->out_cb, scratch->out_cr);
+
+        libsecam_stream_copy(libsecam_image_row(dst, 0, y), scratch->out_row,
+            (size_t) self->width * libsecam_formats[dst->format].bytes_per_pixel[0]);
+        return;
+    }
+#else
+    (void) nontemporal;
+#endif
+
+    pack(self, dst, y, scratch->out_luma, scratch->out_cb, scratch->out_cr);
+}
+
+/**
+ * Filter the whole frame or part of it.
+ */
+static void libsecam_perform(libsecam_t *self, struct libsecam_scratch_s *scratch,
+    int y0, int y1, libsecam_image_t const *src, libsecam_image_t const *dst)
+{
+    libsecam_pack_func_t pack = libsecam_formats[dst->format].pack;
+    bool half_lines = (self->governor.quality >= LIBSECAM_QUALITY_HALF_LINES);
+    bool nontemporal = libsecam_use_nontemporal(self, dst);
+
+    unsigned char *row_luma;
+    signed char *row_cb;
+    signed char *row_cr;
+
+    libsecam_start_band(self, scratch, src, y0);
+
+    for (int y = y0; y < y1; y++) {
+        // Previous line is still in the output buffers.
+        if (half_lines && (y % 2) && y > y0) {
+            libsecam_pack_line(self, scratch, pack, dst, y, nontemporal);
+            continue;
+        }
+
+        LIBSECAM_TRACE_BEGIN(unpack_start);
+        libsecam_fetch_line(self, scratch, src, y, true,
+            &row_luma, &row_cb, &row_cr);
+        LIBSECAM_TRACE_END(unpack_start, "unpack", self->frame_count, "row", y);
+
+        libsecam_process_line(self, scratch, row_luma, row_cb, row_cr, y);
+
+        LIBSECAM_TRACE_BEGIN(pack_start);
+        libsecam_pack_line(self, scratch, pack, dst, y, nontemporal);
+        LIBSECAM_TRACE_END(pack_start, "pack", self->frame_count, "row", y);
+    }
+
+#ifdef LIBSECAM_HAS_NONTEMPORAL
+    // Streamed rows should be visible once the band is reported done.
+    if (nontemporal) {
+        _mm_sfence();
+    }
+#endif
+}
+
+/**
+ * Free scratch buffers.
+ */
+static void libsecam_free_scratch(struct libsecam_scratch_s *scratch)
+{
+    LIBSECAM_FREE(scratch->luma);
+    LIBSECAM_FREE(scratch->osci);
+    LIBSECAM_FREE(scratch->luma_work);
+    LIBSECAM_FREE(scratch->cb);
+    LIBSECAM_FREE(scratch->cr);
+    LIBSECAM_FREE(scratch->cx);
+    LIBSECAM_FREE(scratch->row_luma);
+    LIBSECAM_FREE(scratch->row_cb);
+    LIBSECAM_FREE(scratch->row_cr);
+    LIBSECAM_FREE(scratch->out_luma);
+    LIBSECAM_FREE(scratch->out_cb);
+    LIBSECAM_FREE(scratch->out_cr);
+    LIBSECAM_FREE(scratch->out_row);
+    LIBSECAM_FREE(scratch->chroma_rand);
+    LIBSECAM_FREE(scratch->fire_mask);
+    LIBSECAM_FREE(scratch->fire_list);
+
+    memset(scratch, 0, sizeof(*scratch));
+}
+
+/**
+ * Make sure scratch buffers are large enough for the instance.
+ */
+static bool libsecam_reserve_scratch(struct libsecam_scratch_s *scratch, libsecam_t const *self)
+{
+    // Grow at least twice at a time, so a few resolution changes
+    // in a row don't reallocate every time.
+    if (scratch->width < self->width) {
+        int width = (self->width > scratch->width * 2) ? self->width : (scratch->width * 2);
+
+        LIBSECAM_FREE(scratch->luma);
+        LIBSECAM_FREE(scratch->luma_work);
+        LIBSECAM_FREE(scratch->row_luma);
+        LIBSECAM_FREE(scratch->row_cb);
+        LIBSECAM_FREE(scratch->row_cr);
+        LIBSECAM_FREE(scratch->out_luma);
+        LIBSECAM_FREE(scratch->out_cb);
+        LIBSECAM_FREE(scratch->out_cr);
+        LIBSECAM_FREE(scratch->out_row);
+
+        scratch->luma = (int *) LIBSECAM_MALLOC(sizeof(*scratch->luma) * width);
+        scratch->luma_work = (int *) LIBSECAM_MALLOC(sizeof(*scratch->luma_work) * width);
+        scratch->row_luma = (unsigned char *) LIBSECAM_MALLOC(sizeof(*scratch->row_luma) * width);
+        scratch->row_cb = (signed char *) LIBSECAM_MALLOC(sizeof(*scratch->row_cb) * width);
+        scratch->row_cr = (signed char *) LIBSECAM_MALLOC(sizeof(*scratch->row_cr) * width);
+        scratch->out_luma = (int *) LIBSECAM_MALLOC(sizeof(*scratch->out_luma) * width);
+        scratch->out_cb = (int *) LIBSECAM_MALLOC(sizeof(*scratch->out_cb) * width);
+        scratch->out_cr = (int *) LIBSECAM_MALLOC(sizeof(*scratch->out_cr) * width);
+        scratch->out_row = (unsigned char *) LIBSECAM_MALLOC(LIBSECAM_MAX_PIXEL_SIZE * width);
+        scratch->width = width;
+
+        if (!scratch->luma || !scratch->luma_work
+            || !scratch->row_luma || !scratch->row_cb || !scratch->row_cr
+            || !scratch->out_luma || !scratch->out_cb || !scratch->out_cr
+            || !scratch->out_row) {
+            libsecam_free_scratch(scratch);
+            return false;
+        }
+    }
+
+    if (scratch->chroma_width < self->chroma_width) {
+        int chroma_width = (self->chroma_width > scratch->chroma_width * 2)
+            ? self->chroma_width : (scratch->chroma_width * 2);
+
+        LIBSECAM_FREE(scratch->osci);
+        LIBSECAM_FREE(scratch->cb);
+        LIBSECAM_FREE(scratch->cr);
+        LIBSECAM_FREE(scratch->cx);
+        LIBSECAM_FREE(scratch->chroma_rand);
+        LIBSECAM_FREE(scratch->fire_mask);
+        LIBSECAM_FREE(scratch->fire_list);
+
+        scratch->osci = (int *) LIBSECAM_MALLOC(sizeof(*scratch->osci) * chroma_width);
+        scratch->cb = (int *) LIBSECAM_MALLOC(sizeof(*scratch->cb) * chroma_width);
+        scratch->cr = (int *) LIBSECAM_MALLOC(sizeof(*scratch->cr) * chroma_width);
+        scratch->cx = (int *) LIBSECAM_MALLOC(sizeof(*scratch->cx) * chroma_width);
+        scratch->chroma_rand = (unsigned int *) LIBSECAM_MALLOC(sizeof(*scratch->chroma_rand) * chroma_width);
+        scratch->fire_mask = (unsigned char *) LIBSECAM_MALLOC(sizeof(*scratch->fire_mask) * chroma_width);
+        scratch->fire_list = (int *) LIBSECAM_MALLOC(sizeof(*scratch->fire_list) * chroma_width);
+        scratch->chroma_width = chroma_width;
+
+        if (!scratch->osci || !scratch->cb || !scratch->cr || !scratch->cx
+            || !scratch->chroma_rand || !scratch->fire_mask || !scratch->fire_list) {
+            libsecam_free_scratch(scratch);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Filter one band of a batch. Returns false if there's not enough memory
+ * for scratch, in which case rows of the band are left untouched.
+ */
+static bool libsecam_perform_band(struct libsecam_batch *batch, int band,
+    struct libsecam_scratch_s *scratch)
+{
+    libsecam_t *self = batch->self;
+
+    int y0 = (self->height * band) / batch->num_bands;
+    int y1 = (self->height * (band + 1)) / batch->num_bands;
+
+    if (!libsecam_reserve_scratch(scratch, self)) {
+        return false;
+    }
+
+    LIBSECAM_TRACE_BEGIN(start);
+    libsecam_perform(self, scratch, y0, y1, &batch->src, &batch->dst);
+    LIBSECAM_TRACE_END(start, "band", self->frame_count, "band", band);
+
+    return true;
+}
+
+#ifdef LIBSECAM_USE_THREADS
+
+/**
+ * Add batch to the end of the engine queue.
+ */
+static void libsecam_push_batch(libsecam_engine_t *engine, struct libsecam_batch *batch)
+{
+    batch->next = NULL;
+
+    if (engine->tail) {
+        engine->tail->next = batch;
+    } else {
+        engine->head = batch;
+    }
+
+    engine->tail = batch;
+}
+
+/**
+ * Remove batch from the front of the engine queue.
+ */
+static struct libsecam_batch *libsecam_pop_batch(libsecam_engine_t *engine)
+{
+    struct libsecam_batch *batch = engine->head;
+
+    engine->head = batch->next;
+
+    if (!engine->head) {
+        engine->tail = NULL;
+    }
+
+    return batch;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI libsecam_worker_main(LPVOID context)
+#else
+static void *libsecam_worker_main(void *context)
+#endif
+{
+    struct libsecam_worker *worker = (struct libsecam_worker *) context;
+    libsecam_engine_t *engine = worker->engine;
+
+    libsecam_lock_mutex(&engine->mutex);
+
+    while (!engine->quit) {
+        if (!engine->head) {
+            libsecam_wait_cond(&engine->wake, &engine->mutex);
+            continue;
+        }
+
+        // Take one band and send the batch to the back of the queue,
+        // so frames of different instances get processed in turns.
+        struct libsecam_batch *batch = libsecam_pop_batch(engine);
+        int band = batch->next_band++;
+
+        if (batch->next_band < batch->num_bands) {
+            libsecam_push_batch(engine, batch);
+        }
+
+        libsecam_unlock_mutex(&engine->mutex);
+        bool done = libsecam_perform_band(batch, band, &worker->scratch);
+        libsecam_lock_mutex(&engine->mutex);
+
+        if (!done) {
+            batch->failed = true;
+        }
+
+        if (--batch->pending == 0) {
+            libsecam_broadcast_cond(&engine->done);
+        }
+    }
+
+    libsecam_unlock_mutex(&engine->mutex);
+
+    return 0;
+}
+
+#endif // LIBSECAM_USE_THREADS
+
+#ifdef LIBSECAM_USE_OPENMP
+
+/**
+ * Make sure there is scratch for every band.
+ */
+static bool libsecam_reserve_bands(libsecam_t *self)
+{
+    if (self->band_scratch_count >= self->num_bands) {
+        return true;
+    }
+
+    struct libsecam_scratch_s *band_scratch = (struct libsecam_scratch_s *) LIBSECAM_MALLOC(sizeof(*band_scratch) * self->num_bands);
+
+    if (!band_scratch) {
+        return false;
+    }
+
+    memset(band_scratch, 0, sizeof(*band_scratch) * self->num_bands);
+
+    if (self->band_scratch) {
+        memcpy(band_scratch, self->band_scratch,
+            sizeof(*band_scratch) * self->band_scratch_count);
+        LIBSECAM_FREE(self->band_scratch);
+    }
+
+    self->band_scratch = band_scratch;
+    self->band_scratch_count = self->num_bands;
+
+    return true;
+}
+
+#endif // LIBSECAM_USE_OPENMP
+
+/**
+ * Filter all bands of the frame and wait until they're done.
+ * Returns false if some of them couldn't be filtered.
+ */
+static bool libsecam_run_batch(libsecam_t *self, libsecam_image_t const *src,
+    libsecam_image_t const *dst)
+{
+    struct libsecam_batch batch;
+
+    batch.self = self;
+    batch.src = *src;
+    batch.dst = *dst;
+    batch.num_bands = self->num_bands;
+    batch.next_band = 0;
+    batch.pending = self->num_bands;
+    batch.failed = false;
+    batch.next = NULL;
+
+#ifdef LIBSECAM_USE_THREADS
+    libsecam_engine_t *engine = self->engine;
+
+    if (engine->num_threads > 0) {
+        libsecam_lock_mutex(&engine->mutex);
+        libsecam_push_batch(engine, &batch);
+        libsecam_broadcast_cond(&engine->wake);
+
+        while (batch.pending > 0) {
+            libsecam_wait_cond(&engine->done, &engine->mutex);
+        }
+
+        libsecam_unlock_mutex(&engine->mutex);
+        return !batch.failed;
+    }
+#endif
+
+#ifdef LIBSECAM_USE_OPENMP
+    if (batch.num_bands > 1 && libsecam_reserve_bands(self)) {
+        struct libsecam_scratch_s *band_scratch = self->band_scratch;
+
+        if (omp_in_parallel()) {
+            // Already inside of host's parallel region, let its team
+            // pick up the bands instead of starting a nested region.
+            for (int i = 0; i < batch.num_bands; i++) {
+                #pragma omp task firstprivate(i) shared(batch, band_scratch)
+                if (!libsecam_perform_band(&batch, i, &band_scratch[i])) {
+                    #pragma omp atomic write
+                    batch.failed = true;
+                }
+            }
+
+            #pragma omp taskwait
+        } else {
+            #pragma omp parallel for schedule(dynamic, 1)
+            for (int i = 0; i < batch.num_bands; i++) {
+                if (!libsecam_perform_band(&batch, i, &band_scratch[i])) {
+                    #pragma omp atomic write
+                    batch.failed = true;
+                }
+            }
+        }
+
+        return !batch.failed;
+    }
+#endif
+
+    // No workers, do everything in this thread.
+    for (int i = 0; i < batch.num_bands; i++) {
+        if (!libsecam_perform_band(&batch, i, &self->scratch)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Make atlas of size entries plus padding ready, with noise computed
+ * the same as the filter would per pixel: scale * (random % range - centre).
+ * Luma noise is rounded down with the same bias as libsecam_start_band()
+ * does, chroma noise (`truncate`) is truncated towards zero, as adding it
+ * to int samples does.
+ *
+ * Entries depend only on the seed, scale and their index, so those already
+ * made for the same scale are kept: shrinking only wraps the padding around
+ * again. Memory is reused as long as it's large enough.
+ */
+static bool libsecam_prepare_atlas(struct libsecam_atlas *atlas, int size, int padding,
+    double scale, int range, int centre, unsigned int seed, bool truncate)
+{
+    if (atlas->scale != scale) {
+        atlas->filled = 0;
+    }
+
+    if (atlas->capacity < size + padding) {
+        int capacity = (size + padding > atlas->capacity * 2)
+            ? (size + padding) : (atlas->capacity * 2);
+
+        short *noise = (short *) LIBSECAM_MALLOC(sizeof(*noise) * capacity);
+
+        if (!noise) {
+            return false;
+        }
+
+        if (atlas->filled > 0) {
+            memcpy(noise, atlas->noise, sizeof(*noise) * atlas->filled);
+        }
+
+        LIBSECAM_FREE(atlas->noise);
+        atlas->noise = noise;
+        atlas->capacity = capacity;
+    }
+
+    if (atlas->filled < size) {
+        unsigned int rng = seed;
+
+        for (int i = 0; i < size; i++) {
+            double value = scale * ((libsecam_fastrand(&rng) % range) - centre);
+            atlas->noise[i] = (short) (truncate ? value : floor(value + 1e-9));
+        }
+    }
+
+    // Padding overwrites whatever was made past the end.
+    memcpy(&atlas->noise[size], atlas->noise, sizeof(*atlas->noise) * padding);
+
+    atlas->size = size;
+    atlas->filled = size;
+    atlas->scale = scale;
+
+    return true;
+}
+
+static void libsecam_free_atlas(struct libsecam_atlas *atlas)
+{
+    LIBSECAM_FREE(atlas->noise);
+    memset(atlas, 0, sizeof(*atlas));
+}
+
+/**
+ * Build noise atlas if it's needed and not ready for current options.
+ * Atlas is at least two frames large, so repetition isn't visible.
+ */
+static void libsecam_update_atlas(libsecam_t *self)
+{
+    // Governor may switch to the atlas at any frame, so it's kept ready
+    // while there's a deadline.
+    bool wanted = self->options.noise_atlas || self->deadline > 0.0;
+
+    if (!wanted) {
+        libsecam_free_atlas(&self->luma_atlas);
+        libsecam_free_atlas(&self->chroma_atlas);
+        return;
+    }
+
+    // Chroma noise is scaled by its step, which depends on width.
+    double chroma_scale = self->options.chroma_noise / sqrt(self->chroma_step);
+
+    if (self->luma_atlas.noise && self->chroma_atlas.noise
+        && self->luma_atlas.scale == self->options.luma_noise
+        && self->chroma_atlas.scale == chroma_scale
+        && self->atlas_width == self->width && self->atlas_height == self->height) {
+        return;
+    }
+
+    int luma_size = 1 << 16;
+    int chroma_size = 1 << 16;
+
+    while (luma_size < 2 * self->width * self->height) {
+        luma_size *= 2;
+    }
+
+    while (chroma_size < 2 * self->chroma_width * self->height) {
+        chroma_size *= 2;
+    }
+
+    bool ready = libsecam_prepare_atlas(&self->luma_atlas, luma_size, self->width,
+            self->options.luma_noise, 255, 128, self->seed, false)
+        && libsecam_prepare_atlas(&self->chroma_atlas, chroma_size, self->chroma_width,
+            chroma_scale, 512, 256, libsecam_mix_seed(self->seed, 0, 1), true);
+
+    if (!ready) {
+        // Not enough memory, keep calling the RNG then.
+        libsecam_free_atlas(&self->luma_atlas);
+        libsecam_free_atlas(&self->chroma_atlas);
+        return;
+    }
+
+    self->atlas_width = self->width;
+    self->atlas_height = self->height;
+}
+
+/**
+ * Step between control points of vertical profiles.
+ */
+static int libsecam_profile_step(libsecam_t const *self)
+{
+    int step = self->height / 64;
+
+    if (step < 1) {
+        step = 1; // small regions
+    }
+
+    return step;
+}
+
+/**
+ * Random horizontal offsets of rows, used for wobble effect.
+ */
+static void libsecam_make_noise_profile(libsecam_t *self)
+{
+    int step = libsecam_profile_step(self);
+
+    for (int y = 0; y < self->height; y += step) {
+        self->vertical_noise[y] = libsecam_fastrand(&self->rng) / 32768.0;
+    }
+
+    libsecam_lerp_line(self->vertical_noise, self->height, step);
+}
+
+/**
+ * Smoothed brightness of rows, used for skew effect.
+ */
+static void libsecam_make_level_profile(libsecam_t *self)
+{
+    int step = libsecam_profile_step(self);
+
+    // Mean of the rows up to the next step, the last step may be shorter.
+    for (int y = 0; y < self->height; y += step) {
+        double sum = 0.0;
+        int count = 0;
+
+        for (int j = 0; j < step && (y + j) < self->height; j++) {
+            sum += self->row_level[y + j];
+            count++;
+        }
+
+        self->vertical_level[y] = sum / count;
+    }
+
+    libsecam_lerp_line(self->vertical_level, self->height, step);
+}
+
+/**
+ * Pick quality of the next frame from time of the last one.
+ * Quality is lowered as soon as a frame comes close to the deadline and
+ * raised back after a run of frames well within it. If a frame comes close
+ * again before the raised quality has held for as long as that run, the run
+ * is doubled, so quality doesn't flip between two levels every few frames.
+ */
+static void libsecam_govern(libsecam_t *self, double ms)
+{
+    libsecam_governor_stats_t *stats = &self->governor;
+    libsecam_quality_t previous = stats->quality;
+    libsecam_quality_t quality = previous;
+
+    stats->frames++;
+    stats->last_ms = ms;
+    stats->average_ms = (stats->frames == 1) ? ms
+        : (stats->average_ms + (ms - stats->average_ms) / 8.0);
+
+    if (ms > stats->worst_ms) {
+        stats->worst_ms = ms;
+    }
+
+    if (ms > self->deadline) {
+        stats->missed++;
+    }
+
+    if (ms > self->deadline * LIBSECAM_GOVERNOR_RISK) {
+        self->calm_frames = 0;
+
+        if (quality < LIBSECAM_TOTAL_QUALITY_LEVELS - 1) {
+            if (self->since_restore >= 0 && self->restore_after < 32 * LIBSECAM_GOVERNOR_RESTORE) {
+                self->restore_after *= 2;
+            }
+
+            self->since_restore = -1;
+            quality = (libsecam_quality_t) (quality + 1);
+            stats->degrades++;
+        }
+    } else {
+        if (ms < self->deadline * LIBSECAM_GOVERNOR_CALM) {
+            self->calm_frames++;
+        } else {
+            self->calm_frames = 0;
+        }
+
+        if (self->since_restore >= 0 && ++self->since_restore >= self->restore_after) {
+            self->since_restore = -1;
+            self->restore_after = LIBSECAM_GOVERNOR_RESTORE;
+        }
+
+        if (quality > LIBSECAM_QUALITY_FULL && self->calm_frames >= self->restore_after) {
+            self->calm_frames = 0;
+            self->since_restore = 0;
+            quality = (libsecam_quality_t) (quality - 1);
+            stats->restores++;
+        }
+    }
+
+    stats->quality = quality;
+
+    if (quality != previous && self->governor_func) {
+        self->governor_func(self->governor_user, stats, previous);
+    }
+}
+
+/**
+ * Name of the processor, wisdom is only good for the one it was measured on.
+ */
+static void libsecam_cpu_model(char *model, size_t size)
+{
+    char name[256] = "";
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int regs[12];
+
+    __cpuid(regs, 0x80000000);
+
+    if ((unsigned int) regs[0] >= 0x80000004u) {
+        __cpuid(&regs[0], 0x80000002);
+        __cpuid(&regs[4], 0x80000003);
+        __cpuid(&regs[8], 0x80000004);
+        memcpy(name, regs, sizeof(regs));
+    }
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int regs[12];
+
+    if (__get_cpuid_max(0x80000000u, NULL) >= 0x80000004u) {
+        __get_cpuid(0x80000002u, &regs[0], &regs[1], &regs[2], &regs[3]);
+        __get_cpuid(0x80000003u, &regs[4], &regs[5], &regs[6], &regs[7]);
+        __get_cpuid(0x80000004u, &regs[8], &regs[9], &regs[10], &regs[11]);
+        memcpy(name, regs, sizeof(regs));
+    }
+#else
+    // Not every ARM kernel tells model name, part number is better than nothing.
+    FILE *file = fopen("/proc/cpuinfo", "r");
+
+    if (file) {
+        char line[256];
+
+        while (fgets(line, sizeof(line), file)) {
+            char const *colon = strchr(line, ':');
+
+            if (colon && (strncmp(line, "model name", 10) == 0
+                || strncmp(line, "Hardware", 8) == 0
+                || strncmp(line, "CPU part", 8) == 0)) {
+                strncpy(name, colon + 1, sizeof(name) - 1);
+                break;
+            }
+        }
+
+        fclose(file);
+    }
+#endif
+
+    // Brand strings are padded with spaces, wisdom lines end with the name.
+    char const *p = name;
+    size_t length = 0;
+
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+
+    for (; *p && length + 1 < size; p++) {
+        model[length++] = ((unsigned char) *p < ' ') ? ' ' : *p;
+    }
+
+    while (length > 0 && model[length - 1] == ' ') {
+        length--;
+    }
+
+    model[length] = '\0';
+
+    if (length == 0) {
+        strncpy(model, "unknown", size - 1);
+        model[size - 1] = '\0';
+    }
+}
+
+/**
+ * Size of the last level cache, or LIBSECAM_DEFAULT_LLC_SIZE if it can't
+ * be found.
+ */
+static size_t libsecam_llc_size(void)
+{
+    size_t size = 0;
+
+#if defined(_WIN32)
+    DWORD length = 0;
+
+    GetLogicalProcessorInformation(NULL, &length);
+
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info =
+        (SYSTEM_LOGICAL_PROCESSOR_INFORMATION *) LIBSECAM_MALLOC(length);
+
+    if (info && GetLogicalProcessorInformation(info, &length)) {
+        for (DWORD i = 0; i < length / sizeof(*info); i++) {
+            if (info[i].Relationship == RelationCache && info[i].Cache.Size > size) {
+                size = info[i].Cache.Size;
+            }
+        }
+    }
+
+    LIBSECAM_FREE(info);
+#elif defined(_SC_LEVEL3_CACHE_SIZE)
+    long l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+
+    size = (l3 > 0) ? (size_t) l3 : ((l2 > 0) ? (size_t) l2 : 0);
+#endif
+
+#if defined(__linux__)
+    // Not every libc asks the kernel, and not every CPU tells cpuid.
+    for (int index = 3; size == 0 && index >= 2; index--) {
+        char path[64];
+        unsigned long kilobytes;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+
+        FILE *file = fopen(path, "r");
+
+        if (file) {
+            if (fscanf(file, "%luK", &kilobytes) == 1) {
+                size = (size_t) kilobytes * 1024;
+            }
+
+            fclose(file);
+        }
+    }
+#endif
+
+    return size ? size : (size_t) LIBSECAM_DEFAULT_LLC_SIZE;
+}
+
+/**
+ * Find band count measured earlier for this processor, frame size and
+ * thread count. Later entries win. Returns 0 if there's none.
+ */
+static int libsecam_load_wisdom(char const *path, char const *model,
+    int width, int height, int threads, int *nontemporal)
+{
+    FILE *file = fopen(path, "r");
+
+    if (!file) {
+        return 0;
+    }
+
+    char line[512];
+    int bands = 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        int w, h, t, b, s;
+        int n = 0;
+
+        // Lines without store kind, written by older versions, don't parse
+        // and are measured again.
+        if (sscanf(line, "%d %d %d %d %d %n", &w, &h, &t, &b, &s, &n) != 5 || n == 0) {
+            continue; // comment or garbage
+        }
+
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (w == width && h == height && t == threads && b > 0
+            && strcmp(line + n, model) == 0) {
+            bands = b;
+            *nontemporal = s;
+        }
+    }
+
+    fclose(file);
+
+    return bands;
+}
+
+/**
+ * Append measured settings to the wisdom file.
+ * Line format: width height threads bands stores model, where stores is
+ * 1 for non-temporal, 0 for cached and -1 if they weren't compared.
+ */
+static bool libsecam_save_wisdom(char const *path, char const *model,
+    int width, int height, int threads, int bands, int nontemporal)
+{
+    FILE *file = fopen(path, "a");
+
+    if (!file) {
+        return false;
+    }
+
+    fprintf(file, "%d %d %d %d %d %s\n", width, height, threads, bands, nontemporal, model);
+
+    return fclose(file) == 0;
+}
+
+/**
+ * Apply store kind picked by libsecam_autotune(), -1 keeps the threshold.
+ */
+static void libsecam_apply_nontemporal(libsecam_t *self, int nontemporal)
+{
+    if (nontemporal > 0) {
+        self->nontemporal_threshold = 0;
+    } else if (nontemporal == 0) {
+        self->nontemporal_threshold = (size_t) -1;
+    }
+}
+
+/**
+ * Time filtering of a test frame split into the given number of bands,
+ * in microseconds. The first frame only warms up caches and buffers.
+ */
+static double libsecam_measure_bands(libsecam_t *self, int bands,
+    libsecam_image_t const *src, libsecam_image_t const *dst)
+{
+    double best = 0.0;
+
+    self->num_bands = bands;
+
+    for (int i = 0; i <= LIBSECAM_AUTOTUNE_FRAMES; i++) {
+        double start = libsecam_clock();
+
+        libsecam_begin_image(self, src);
+        libsecam_run_batch(self, src, dst);
+
+        double time = libsecam_clock() - start;
+
+        if (i == 1 || (i > 1 && time < best)) {
+            best = time;
+        }
+    }
+
+    return best;
+}
+
+//------------------------------------------------------------------------------
+
+libsecam_engine_t *libsecam_engine_init(int num_threads)
+{
+    libsecam_engine_t *engine = (libsecam_engine_t *) LIBSECAM_MALLOC(sizeof(libsecam_engine_t));
+
+    if (!engine) {
+        return NULL;
+    }
+
+    memset(engine, 0, sizeof(*engine));
+
+#ifdef LIBSECAM_USE_THREADS
+    if (num_threads <= 0) {
+        num_threads = libsecam_count_cpus();
+    }
+
+    if (num_threads <= 0) {
+        num_threads = LIBSECAM_NUM_THREADS;
+    }
+
+    engine->workers = (struct libsecam_worker *) LIBSECAM_MALLOC(sizeof(*engine->workers) * num_threads);
+
+    if (!engine->workers) {
+        LIBSECAM_FREE(engine);
+        return NULL;
+    }
+
+    memset(engine->workers, 0, sizeof(*engine->workers) * num_threads);
+
+    libsecam_init_mutex(&engine->mutex);
+    libsecam_init_cond(&engine->wake);
+    libsecam_init_cond(&engine->done);
+
+    engine->num_threads = num_threads;
+
+    for (int i = 0; i < num_threads; i++) {
+        engine->workers[i].engine = engine;
+        libsecam_create_thread(&engine->workers[i].thread,
+            libsecam_worker_main, &engine->workers[i]);
+    }
+#elif defined(LIBSECAM_USE_OPENMP)
+    // No workers here, OpenMP runtime has its own.
+    // The number is only used as default band count.
+    engine->num_threads = (num_threads > 0) ? num_threads : omp_get_max_threads();
+#else
+    (void) num_threads;
+    engine->num_threads = 0;
+#endif
+
+    return engine;
+}
+
+void libsecam_engine_close(libsecam_engine_t *engine)
+{
+#ifdef LIBSECAM_USE_THREADS
+    libsecam_lock_mutex(&engine->mutex);
+    engine->quit = true;
+    libsecam_broadcast_cond(&engine->wake);
+    libsecam_unlock_mutex(&engine->mutex);
+
+    for (int i = 0; i < engine->num_threads; i++) {
+        libsecam_wait_thread(engine->workers[i].thread);
+        libsecam_free_scratch(&engine->workers[i].scratch);
+    }
+
+    libsecam_destroy_cond(&engine->done);
+    libsecam_destroy_cond(&engine->wake);
+    libsecam_destroy_mutex(&engine->mutex);
+
+    LIBSECAM_FREE(engine->workers);
+#endif
+
+    LIBSECAM_FREE(engine);
+}
+
+/**
+ * Set frame size and everything that depends on it.
+ */
+static void libsecam_set_size(libsecam_t *self, int width, int height)
+{
+    self->width = width;
+    self->height = height;
+
+    // Calculate loss values.
+    // Target for 240 TVL for luminance and 60 TVL for chrominance.
+
+    self->luma_loss = 1;
+    self->chroma_loss = 1;
+
+    while (self->luma_loss <= (self->width / 240)) {
+        self->luma_loss *= 2;
+    }
+
+    while (self->chroma_loss <= (self->width / 60)) {
+        self->chroma_loss *= 2;
+    }
+
+    // Chroma can't hold more detail than chroma_loss allows anyway,
+    // so keep only a few samples per chroma loss cell.
+
+    self->chroma_step = self->chroma_loss / LIBSECAM_CHROMA_SUBSAMPLES;
+
+    if (self->chroma_step < 1) {
+        self->chroma_step = 1;
+    }
+
+    self->chroma_width = (self->width + self->chroma_step - 1) / self->chroma_step;
+}
+
+/**
+ * Make sure per-row buffers have room for the given number of rows.
+ * Brightness of the previous frame is reset, since its rows don't match
+ * the new ones anyway. On failure, the old buffers are kept.
+ */
+static bool libsecam_reserve_rows(libsecam_t *self, int height)
+{
+    if (self->row_capacity < height) {
+        int capacity = (height > self->row_capacity * 2) ? height : (self->row_capacity * 2);
+
+        double *vertical_noise = (double *) LIBSECAM_MALLOC(sizeof(*vertical_noise) * capacity);
+        double *vertical_level = (double *) LIBSECAM_MALLOC(sizeof(*vertical_level) * capacity);
+        double *row_level = (double *) LIBSECAM_MALLOC(sizeof(*row_level) * capacity);
+        unsigned long long *row_hash = (unsigned long long *) LIBSECAM_MALLOC(sizeof(*row_hash) * capacity);
+        bool *row_dirty = (bool *) LIBSECAM_MALLOC(sizeof(*row_dirty) * capacity);
+
+        if (!vertical_noise || !vertical_level || !row_level || !row_hash || !row_dirty) {
+            LIBSECAM_FREE(vertical_noise);
+            LIBSECAM_FREE(vertical_level);
+            LIBSECAM_FREE(row_level);
+            LIBSECAM_FREE(row_hash);
+            LIBSECAM_FREE(row_dirty);
+            return false;
+        }
+
+        LIBSECAM_FREE(self->vertical_noise);
+        LIBSECAM_FREE(self->vertical_level);
+        LIBSECAM_FREE(self->row_level);
+        LIBSECAM_FREE(self->row_hash);
+        LIBSECAM_FREE(self->row_dirty);
+
+        self->vertical_noise = vertical_noise;
+        self->vertical_level = vertical_level;
+        self->row_level = row_level;
+        self->row_hash = row_hash;
+        self->row_dirty = row_dirty;
+        self->row_capacity = capacity;
+    }
+
+    // Streamed frames use brightness of the previous one, which is none yet.
+    memset(self->vertical_level, 0, sizeof(*self->vertical_level) * height);
+    memset(self->row_level, 0, sizeof(*self->row_level) * height);
+
+    return true;
+}
+
+libsecam_t *libsecam_init(int width, int height)
+{
+    if (width <= 0 || height <= 0) {
+        return NULL;
+    }
+
+    libsecam_engine_t *engine = libsecam_engine_init(LIBSECAM_NUM_THREADS);
+
+    if (!engine) {
+        return NULL;
+    }
+
+    libsecam_t *self = libsecam_init_shared(engine, width, height);
+
+    if (!self) {
+        libsecam_engine_close(engine);
+        return NULL;
+    }
+
+    self->owns_engine = true;
+
+    return self;
+}
+
+libsecam_t *libsecam_init_shared(libsecam_engine_t *engine, int width, int height)
+{
+    if (width <= 0 || height <= 0) {
+        return NULL;
+    }
+
+    libsecam_t *self = (libsecam_t *) LIBSECAM_MALLOC(sizeof(libsecam_t));
+
+    if (!self) {
+        return NULL;
+    }
+
+    memset(self, 0, sizeof(*self));
+
+    self->engine = engine;
+    self->owns_engine = false;
+    self->num_bands = (engine->num_threads > 0) ? engine->num_threads : 1;
+
+    self->options.luma_noise = LIBSECAM_DEFAULT_LUMA_NOISE;
+    self->options.chroma_noise = LIBSECAM_DEFAULT_CHROMA_NOISE;
+    self->options.chroma_fire = LIBSECAM_DEFAULT_CHROMA_FIRE;
+    self->options.echo = LIBSECAM_DEFAULT_ECHO;
+    self->options.skew = LIBSECAM_DEFAULT_SKEW;
+    self->options.wobble = LIBSECAM_DEFAULT_WOBBLE;
+    self->options.static_cache = false;
+    self->options.noise_atlas = false;
+
+    libsecam_set_size(self, width, height);
+
+    if (!libsecam_reserve_rows(self, height)) {
+        LIBSECAM_FREE(self);
+        return NULL;
+    }
+
+    self->frame_capacity = (size_t) width * height;
+
+    // Frame cache will be initialized later if used.
+    self->cached_luma = NULL;
+    self->cached_cb = NULL;
+    self->cached_cr = NULL;
+
+    self->output = NULL; // Will be initialized later if used.
+    self->seed = LIBSECAM_DEFAULT_SEED;
+    self->rng = self->seed;
+    self->frame_count = 0;
+    self->stream_line = -1;
+
+    libsecam_set_deadline(self, 0.0);
+    self->nontemporal_threshold = libsecam_llc_size();
+
+    return self;
+}
+
+void libsecam_close(libsecam_t *self)
+{
+    LIBSECAM_FREE(self->vertical_noise);
+    LIBSECAM_FREE(self->vertical_level);
+    LIBSECAM_FREE(self->row_level);
+    LIBSECAM_FREE(self->row_hash);
+    LIBSECAM_FREE(self->row_dirty);
+    LIBSECAM_FREE(self->cached_luma);
+    LIBSECAM_FREE(self->cached_cb);
+    LIBSECAM_FREE(self->cached_cr);
+    libsecam_free_atlas(&self->luma_atlas);
+    libsecam_free_atlas(&self->chroma_atlas);
+
+    libsecam_free_scratch(&self->scratch);
+
+#ifdef LIBSECAM_USE_OPENMP
+    for (int i = 0; i < self->band_scratch_count; i++) {
+        libsecam_free_scratch(&self->band_scratch[i]);
+    }
+
+    LIBSECAM_FREE(self->band_scratch);
+#endif
+
+    if (self->owns_engine) {
+        libsecam_engine_close(self->engine);
+    }
+
+    LIBSECAM_FREE(self->output);
+    LIBSECAM_FREE(self);
+}
+
+bool libsecam_resize(libsecam_t *self, int width, int height)
+{
+    if (width <= 0 || height <= 0) {
+        return false;
+    }
+
+    if (width == self->width && height == self->height) {
+        return true;
+    }
+
+    if (!libsecam_reserve_rows(self, height)) {
+        return false;
+    }
+
+    size_t pixels = (size_t) width * height;
+
+    // Frame buffers are allocated on first use, at full capacity.
+    if (pixels > self->frame_capacity) {
+        LIBSECAM_FREE(self->cached_luma);
+        LIBSECAM_FREE(self->cached_cb);
+        LIBSECAM_FREE(self->cached_cr);
+        LIBSECAM_FREE(self->output);
+
+        self->cached_luma = NULL;
+        self->cached_cb = NULL;
+        self->cached_cr = NULL;
+        self->output = NULL;
+
+        self->frame_capacity = (pixels > self->frame_capacity * 2)
+            ? pixels : (self->frame_capacity * 2);
+    }
+
+    libsecam_set_size(self, width, height);
+
+    self->cache_valid = false;
+    self->hint_unchanged = false;
+    self->stream_line = -1;
+
+    return true;
+}
+
+libsecam_options_t *libsecam_options(libsecam_t *self)
+{
+    return &self->options;
+}
+
+void libsecam_hint_unchanged(libsecam_t *self)
+{
+    self->hint_unchanged = true;
+}
+
+void libsecam_set_threads(libsecam_t *self, int num_threads)
+{
+    if (num_threads <= 0) {
+        num_threads = self->engine->num_threads;
+    }
+
+    self->num_bands = (num_threads > 0) ? num_threads : 1;
+}
+
+void libsecam_seed(libsecam_t *self, unsigned int seed)
+{
+    self->seed = seed;
+    self->rng = seed;
+    self->frame_count = 0;
+}
+
+void libsecam_set_deadline(libsecam_t *self, double milliseconds)
+{
+    self->deadline = (milliseconds > 0.0) ? milliseconds : 0.0;
+
+    memset(&self->governor, 0, sizeof(self->governor));
+    self->governor.quality = LIBSECAM_QUALITY_FULL;
+
+    self->calm_frames = 0;
+    self->restore_after = LIBSECAM_GOVERNOR_RESTORE;
+    self->since_restore = -1;
+}
+
+void libsecam_set_governor_callback(libsecam_t *self,
+    libsecam_governor_func_t func, void *user)
+{
+    self->governor_func = func;
+    self->governor_user = user;
+}
+
+libsecam_governor_stats_t const *libsecam_governor_stats(libsecam_t const *self)
+{
+    return &self->governor;
+}
+
+void libsecam_set_nontemporal_threshold(libsecam_t *self, size_t bytes)
+{
+    self->nontemporal_threshold = bytes;
+}
+
+int libsecam_autotune(libsecam_t *self, char const *wisdom_path)
+{
+    int threads = self->engine->num_threads;
+    char model[128];
+
+    libsecam_cpu_model(model, sizeof(model));
+
+    if (wisdom_path) {
+        int nontemporal = -1;
+        int bands = libsecam_load_wisdom(wisdom_path, model,
+            self->width, self->height, threads, &nontemporal);
+
+        if (bands > 0) {
+            self->num_bands = bands;
+            libsecam_apply_nontemporal(self, nontemporal);
+            return bands;
+        }
+    }
+
+    size_t size = (size_t) self->width * self->height * 4;
+    size_t rows = sizeof(double) * self->height;
+    unsigned char *src_pixels = (unsigned char *) LIBSECAM_MALLOC(size);
+    unsigned char *dst_pixels = (unsigned char *) LIBSECAM_MALLOC(size);
+    double *row_level = (double *) LIBSECAM_MALLOC(rows);
+    double *vertical_level = (double *) LIBSECAM_MALLOC(rows);
+
+    if (!src_pixels || !dst_pixels || !row_level || !vertical_level) {
+        LIBSECAM_FREE(src_pixels);
+        LIBSECAM_FREE(dst_pixels);
+        LIBSECAM_FREE(row_level);
+        LIBSECAM_FREE(vertical_level);
+        return 0;
+    }
+
+    // Bars with some texture, so there are edges and fires to work on.
+    for (int y = 0; y < self->height; y++) {
+        for (int x = 0; x < self->width; x++) {
+            unsigned char *pixel = &src_pixels[((size_t) y * self->width + x) * 4];
+            int bar = (x * 8) / self->width;
+
+            pixel[0] = (bar & 4) ? 192 : 16;
+            pixel[1] = (bar & 2) ? 192 : 16;
+            pixel[2] = (bar & 1) ? 192 : 16;
+            pixel[3] = 255;
+            pixel[(x ^ y) % 3] += (unsigned char) ((x * 7 + y * 13) & 31);
+        }
+    }
+
+    libsecam_image_t src;
+    libsecam_image_t dst;
+
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+
+    src.format = LIBSECAM_FORMAT_XRGB;
+    src.planes[0] = src_pixels;
+    src.pitches[0] = self->width * 4;
+
+    dst.format = LIBSECAM_FORMAT_XRGB;
+    dst.planes[0] = dst_pixels;
+    dst.pitches[0] = self->width * 4;
+
+    // Test frames shouldn't change noise of real ones, nor skew of the next
+    // streamed one, which comes from brightness of the last frame. Neither
+    // cache nor governor should make some settings look faster than others.
+    int frame_count = self->frame_count;
+    unsigned int rng = self->rng;
+    bool static_cache = self->options.static_cache;
+    bool hint_unchanged = self->hint_unchanged;
+    libsecam_quality_t quality = self->governor.quality;
+    size_t nontemporal_threshold = self->nontemporal_threshold;
+
+    memcpy(row_level, self->row_level, rows);
+    memcpy(vertical_level, self->vertical_level, rows);
+
+    self->options.static_cache = false;
+    self->hint_unchanged = false;
+    self->governor.quality = LIBSECAM_QUALITY_FULL;
+
+    // Bands run one after another without workers, so one is the best then.
+    // Otherwise, more bands than threads balance better when some bands
+    // are slower, but each of them has to convert a line above it first.
+    int best_bands = 1;
+
+    if (threads > 1) {
+        double best_time = 0.0;
+        int first = (threads / 4 > 0) ? (threads / 4) : 1;
+
+        best_bands = threads;
+
+        for (int bands = first; bands <= 4 * threads && bands <= self->height / 2; bands++) {
+            if ((bands & (bands - 1)) != 0 && (bands % threads) != 0) {
+                continue;
+            }
+
+            double time = libsecam_measure_bands(self, bands, &src, &dst);
+
+            if (best_time == 0.0 || time < best_time) {
+                best_time = time;
+                best_bands = bands;
+            }
+        }
+    }
+
+    // Both kinds of stores give the same output, the one picked by the
+    // threshold wins close calls.
+    int nontemporal = -1;
+
+#ifdef LIBSECAM_HAS_NONTEMPORAL
+    bool by_default = libsecam_use_nontemporal(self, &dst);
+
+    self->nontemporal_threshold = 0;
+    double streamed = libsecam_measure_bands(self, best_bands, &src, &dst);
+    self->nontemporal_threshold = (size_t) -1;
+    double cached = libsecam_measure_bands(self, best_bands, &src, &dst);
+
+    if (by_default) {
+        nontemporal = (cached < streamed * 0.98) ? 0 : 1;
+    } else {
+        nontemporal = (streamed < cached * 0.98) ? 1 : 0;
+    }
+#endif
+
+    self->frame_count = frame_count;
+    self->rng = rng;
+    self->options.static_cache = static_cache;
+    self->hint_unchanged = hint_unchanged;
+    self->governor.quality = quality;
+    self->nontemporal_threshold = nontemporal_threshold;
+    self->cache_valid = false;
+    self->num_bands = best_bands;
+
+    memcpy(self->row_level, row_level, rows);
+    memcpy(self->vertical_level, vertical_level, rows);
+
+    libsecam_apply_nontemporal(self, nontemporal);
+
+    LIBSECAM_FREE(src_pixels);
+    LIBSECAM_FREE(dst_pixels);
+    LIBSECAM_FREE(row_level);
+    LIBSECAM_FREE(vertical_level);
+
+    if (wisdom_path) {
+        libsecam_save_wisdom(wisdom_path, model, self->width, self->height,
+            threads, best_bands, nontemporal);
+    }
+
+    return best_bands;
+}
+
+libsecam_scratch_t *libsecam_scratch_init(void)
+{
+    libsecam_scratch_t *scratch = (libsecam_scratch_t *) LIBSECAM_MALLOC(sizeof(libsecam_scratch_t));
+
+    if (!scratch) {
+        return NULL;
+    }
+
+    // Buffers are allocated by the first libsecam_filter_rows() call.
+    memset(scratch, 0, sizeof(*scratch));
+
+    return scratch;
+}
+
+void libsecam_scratch_close(libsecam_scratch_t *scratch)
+{
+    libsecam_free_scratch(scratch);
+    LIBSECAM_FREE(scratch);
+}
+
+void libsecam_begin_image(libsecam_t *self, libsecam_image_t const *src)
+{
+    if ((unsigned int) src->format >= LIBSECAM_TOTAL_FORMATS) {
+        return;
+    }
+
+    self->frame_count++;
+
+    libsecam_level_func_t level = libsecam_formats[src->format].level;
+
+    libsecam_make_noise_profile(self);
+    libsecam_update_atlas(self);
+
+    // Find out which rows have changed since the last frame.
+
+    if (self->options.static_cache && !self->cached_luma) {
+        size_t size = self->frame_capacity;
+
+        self->cached_luma = (unsigned char *) LIBSECAM_MALLOC(sizeof(*self->cached_luma) * size);
+        self->cached_cb = (signed char *) LIBSECAM_MALLOC(sizeof(*self->cached_cb) * size);
+        self->cached_cr = (signed char *) LIBSECAM_MALLOC(sizeof(*self->cached_cr) * size);
+        self->cache_valid = false;
+
+        // Cache stays off unless all three planes are there.
+        if (!self->cached_luma || !self->cached_cb || !self->cached_cr) {
+            LIBSECAM_FREE(self->cached_luma);
+            LIBSECAM_FREE(self->cached_cb);
+            LIBSECAM_FREE(self->cached_cr);
+
+            self->cached_luma = NULL;
+            self->cached_cb = NULL;
+            self->cached_cr = NULL;
+        }
+    }
+
+    bool use_cache = self->options.static_cache && self->cached_luma;
+
+    for (int y = 0; y < self->height; y++) {
+        self->row_dirty[y] = true;
+
+        if (use_cache && self->cache_valid) {
+            if (self->hint_unchanged) {
+                self->row_dirty[y] = false;
+            } else {
+                unsigned long long hash = libsecam_hash_line(self, src, y);
+                self->row_dirty[y] = (hash != self->row_hash[y]);
+                self->row_hash[y] = hash;
+            }
+        } else if (use_cache) {
+            self->row_hash[y] = libsecam_hash_line(self, src, y);
+        }
+
+        if (!self->row_dirty[y]) {
+            continue;
+        }
+
+        self->row_level[y] = level(self, src, y);
+    }
+
+    // Lines repeated by the governor aren't unpacked into the cache.
+    self->cache_valid = use_cache
+        && self->governor.quality < LIBSECAM_QUALITY_HALF_LINES;
+    self->hint_unchanged = false;
+
+    libsecam_make_level_profile(self);
+}
+
+void libsecam_begin_frame(libsecam_t *self, unsigned char const *src)
+{
+    libsecam_image_t src_image;
+
+    memset(&src_image, 0, sizeof(src_image));
+
+    src_image.format = LIBSECAM_FORMAT_XRGB;
+    src_image.planes[0] = (unsigned char *) src;
+    src_image.pitches[0] = self->width * 4;
+
+    libsecam_begin_image(self, &src_image);
+}
+
+void libsecam_filter_image_rows(libsecam_t *self, int y0, int y1,
+    libsecam_image_t const *src, libsecam_image_t const *dst,
+    libsecam_scratch_t *scratch)
+{
+    if ((unsigned int) src->format >= LIBSECAM_TOTAL_FORMATS
+        || (unsigned int) dst->format >= LIBSECAM_TOTAL_FORMATS) {
+        return;
+    }
+
+    if (y0 < 0) {
+        y0 = 0;
+    }
+
+    if (y1 > self->height) {
+        y1 = self->height;
+    }
+
+    if (y0 >= y1 || !libsecam_reserve_scratch(scratch, self)) {
+        return;
+    }
+
+    LIBSECAM_TRACE_BEGIN(start);
+    libsecam_perform(self, scratch, y0, y1, src, dst);
+    LIBSECAM_TRACE_END(start, "rows", self->frame_count, "first_row", y0);
+}
+
+void libsecam_filter_rows(libsecam_t *self, int y0, int y1,
+    unsigned char const *src, unsigned char *dst, libsecam_scratch_t *scratch)
+{
+    libsecam_image_t src_image;
+    libsecam_image_t dst_image;
+
+    memset(&src_image, 0, sizeof(src_image));
+    memset(&dst_image, 0, sizeof(dst_image));
+
+    src_image.format = LIBSECAM_FORMAT_XRGB;
+    src_image.planes[0] = (unsigned char *) src;
+    src_image.pitches[0] = self->width * 4;
+
+    dst_image.format = LIBSECAM_FORMAT_XRGB;
+    dst_image.planes[0] = dst;
+    dst_image.pitches[0] = self->width * 4;
+
+    libsecam_filter_image_rows(self, y0, y1, &src_image, &dst_image, scratch);
+}
+
+bool libsecam_filter_image(libsecam_t *self, libsecam_image_t const *src,
+    libsecam_image_t const *dst)
+{
+    if ((unsigned int) src->format >= LIBSECAM_TOTAL_FORMATS
+        || (unsigned int) dst->format >= LIBSECAM_TOTAL_FORMATS) {
+        return false;
+    }
+
+    double start_time = (self->deadline > 0.0) ? libsecam_clock() : 0.0;
+
+    LIBSECAM_TRACE_BEGIN(start);
+
+    libsecam_begin_image(self, src);
+
+    LIBSECAM_TRACE_END(start, "pre-pass", self->frame_count, NULL, 0);
+
+    bool done = libsecam_run_batch(self, src, dst);
+
+    LIBSECAM_TRACE_END(start, "frame", self->frame_count, "quality", self->governor.quality);
+
+    if (!done) {
+        // Rows of the failed bands weren't cached.
+        self->cache_valid = false;
+        return false;
+    }
+
+    if (self->deadline > 0.0) {
+        libsecam_govern(self, (libsecam_clock() - start_time) / 1000.0);
+    }
+
+    return true;
+}
+
+void libsecam_stream_begin(libsecam_t *self)
+{
+    self->frame_count++;
+    self->stream_line = 0;
+
+    // Rows are not hashed while streaming.
+    self->cache_valid = false;
+
+    libsecam_make_noise_profile(self);
+    libsecam_update_atlas(self);
+}
+
+bool libsecam_stream_push_line(libsecam_t *self, unsigned char const *src, unsigned char *dst)
+{
+    int y = self->stream_line;
+
+    if (y < 0 || y >= self->height) {
+        return false;
+    }
+
+    struct libsecam_scratch_s *scratch = &self->scratch;
+
+    if (!libsecam_reserve_scratch(scratch, self)) {
+        return false;
+    }
+
+    // Zero pitch makes every row of the image point to the given line.
+    libsecam_image_t src_image;
+    libsecam_image_t dst_image;
+
+    memset(&src_image, 0, sizeof(src_image));
+    memset(&dst_image, 0, sizeof(dst_image));
+
+    src_image.format = LIBSECAM_FORMAT_XRGB;
+    src_image.planes[0] = (unsigned char *) src;
+
+    dst_image.format = LIBSECAM_FORMAT_XRGB;
+    dst_image.planes[0] = dst;
+
+    struct libsecam_format_info const *format = &libsecam_formats[LIBSECAM_FORMAT_XRGB];
+
+    if (y == 0) {
+        libsecam_start_band(self, scratch, &src_image, 0);
+    }
+
+    self->row_level[y] = format->level(self, &src_image, y);
+
+    format->unpack(self, &src_image, y, scratch->row_luma, scratch->row_cb, scratch->row_cr);
+    libsecam_process_line(self, scratch, scratch->row_luma, scratch->row_cb, scratch->row_cr, y);
+    format->pack(self, &dst_image, y, scratch->out_luma, scratch->out_cb, scratch->out_cr);
+
+    self->stream_line++;
+
+    return true;
+}
+
+void libsecam_stream_end(libsecam_t *self)
+{
+    // Brightness of this frame shapes skew of the next one.
+    libsecam_make_level_profile(self);
+
+    self->stream_line = -1;
+}
+
+bool libsecam_filter_region(libsecam_t *self, unsigned char const *src, int src_pitch,
+    unsigned char *dst, int dst_pitch, int left, int top)
+{
+    libsecam_image_t src_image;
+    libsecam_image_t dst_image;
+
+    memset(&src_image, 0, sizeof(src_image));
+    memset(&dst_image, 0, sizeof(dst_image));
+
+    src_image.format = LIBSECAM_FORMAT_XRGB;
+    src_image.planes[0] = (unsigned char *) src + (size_t) src_pitch * top + 4 * left;
+    src_image.pitches[0] = src_pitch;
+
+    dst_image.format = LIBSECAM_FORMAT_XRGB;
+    dst_image.planes[0] = dst + (size_t) dst_pitch * top + 4 * left;
+    dst_image.pitches[0] = dst_pitch;
+
+    return libsecam_filter_image(self, &src_image, &dst_image);
+}
+
+bool libsecam_filter_to_buffer(libsecam_t *self, unsigned char const *src, unsigned char *dst)
+{
+    return libsecam_filter_region(self, src, self->width * 4, dst, self->width * 4, 0, 0);
+}
+
+unsigned char const *libsecam_filter(libsecam_t *self, unsigned char const *src)
+{
+    if (!self->output) {
+        self->output = (unsigned char *) LIBSECAM_MALLOC(self->frame_capacity * 4);
+
+        if (!self->output) {
+            return NULL;
+        }
+    }
+
+    if (!libsecam_filter_to_buffer(self, src, self->output)) {
+        return NULL;
+    }
+
+    return self->output;
+}
+
+#ifdef LIBSECAM_TRACE
+
+bool libsecam_trace_dump(char const *path)
+{
+    FILE *file = fopen(path, "w");
+
+    if (!file) {
+        return false;
+    }
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+        "\"args\":{\"name\":\"libsecam\"}}");
+
+#ifdef _WIN32
+    struct libsecam_trace_ring *ring = libsecam_trace_rings;
+    MemoryBarrier();
+#else
+    struct libsecam_trace_ring *ring = __atomic_load_n(&libsecam_trace_rings, __ATOMIC_ACQUIRE);
+#endif
+
+    for (; ring; ring = ring->next) {
+#ifdef _WIN32
+        unsigned int count = ring->count;
+        MemoryBarrier();
+#else
+        unsigned int count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+#endif
+        unsigned int first = (count > LIBSECAM_TRACE_EVENTS) ? (count - LIBSECAM_TRACE_EVENTS) : 0;
+
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":\"thread %d\"}}", ring->tid, ring->tid);
+
+        for (unsigned int i = first; i < count; i++) {
+            struct libsecam_trace_event const *event = &ring->events[i % LIBSECAM_TRACE_EVENTS];
+
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%d",
+                event->name, ring->tid, event->start, event->end - event->start,
+                event->frame);
+
+            if (event->arg_name) {
+                fprintf(file, ",\"%s\":%d", event->arg_name, event->arg);
+            }
+
+            fprintf(file, "}}");
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+
+    return fclose(file) == 0;
+}
+
+void libsecam_trace_clear(void)
+{
+    for (struct libsecam_trace_ring *ring = libsecam_trace_rings; ring; ring = ring->next) {
+        ring->count = 0;
+    }
+}
+
+#endif // LIBSECAM_TRACE
 
 //------------------------------------------------------------------------------
 
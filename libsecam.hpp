@@ -0,0 +1,554 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2023 tuorqai
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+// libsecam.hpp: C++ interface for libsecam
+//
+// Requires C++11. The implementation still comes from libsecam.h, define
+// LIBSECAM_IMPLEMENTATION in one source file before including either header.
+//
+// Usage:
+//      secam::filter filter(width, height);
+//
+//      filter.process(
+//          secam::const_image_view<secam::xrgb>(src, width, height),
+//          secam::image_view<secam::bgr24>(dst, width, height, dst_stride));
+//
+// Planar formats take their planes in braces:
+//      secam::const_image_view<secam::yuv420p>({ y, u, v }, width, height)
+//
+// Pixel format of an image is part of its type, so passing e.g. an RGB24
+// buffer where XRGB is expected won't compile. Only the check is done at
+// compile time: process() passes the images to libsecam_filter_image(),
+// which picks the unpack and pack kernels from its format table. Each of
+// them is already a loop over a line written for its format, so the table
+// costs one indirect call per line, and calling them directly from here
+// would only make them part of the public interface.
+//------------------------------------------------------------------------------
+
+#ifndef TUORQAI_LIBSECAM_HPP
+#define TUORQAI_LIBSECAM_HPP
+
+//------------------------------------------------------------------------------
+
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+#include "libsecam.h"
+
+//------------------------------------------------------------------------------
+
+namespace secam
+{
+    //--------------------------------------------------------------------------
+    // Pixel format tags
+
+    struct format_tag
+    {
+    };
+
+    /**
+     * Format of one plane, pixels of bytes_per_pixel bytes.
+     */
+    template <libsecam_format_t Id, int BytesPerPixel>
+    struct packed_format : format_tag
+    {
+        static constexpr libsecam_format_t id = Id;
+        static constexpr int bytes_per_pixel = BytesPerPixel;
+        static constexpr int num_planes = 1;
+
+        static constexpr int plane_bytes(int) { return BytesPerPixel; }
+        static constexpr int plane_hshift(int) { return 0; }
+    };
+
+    struct xrgb : packed_format<LIBSECAM_FORMAT_XRGB, 4> {};
+    struct xbgr : packed_format<LIBSECAM_FORMAT_XBGR, 4> {};
+    struct rgb24 : packed_format<LIBSECAM_FORMAT_RGB24, 3> {};
+    struct bgr24 : packed_format<LIBSECAM_FORMAT_BGR24, 3> {};
+    struct rgba64 : packed_format<LIBSECAM_FORMAT_RGBA64, 8> {};
+    struct rgba32f : packed_format<LIBSECAM_FORMAT_RGBA32F, 16> {};
+
+    // Planar formats: plane_bytes() is the size of one subsampled pixel
+    // of a plane, plane_hshift() is its horizontal subsampling.
+
+    struct yuv420p : format_tag
+    {
+        static constexpr libsecam_format_t id = LIBSECAM_FORMAT_YUV420P;
+        static constexpr int num_planes = 3;
+
+        static constexpr int plane_bytes(int) { return 1; }
+        static constexpr int plane_hshift(int plane) { return plane ? 1 : 0; }
+    };
+
+    struct yuv444p : format_tag
+    {
+        static constexpr libsecam_format_t id = LIBSECAM_FORMAT_YUV444P;
+        static constexpr int num_planes = 3;
+
+        static constexpr int plane_bytes(int) { return 1; }
+        static constexpr int plane_hshift(int) { return 0; }
+    };
+
+    struct p010 : format_tag
+    {
+        static constexpr libsecam_format_t id = LIBSECAM_FORMAT_P010;
+        static constexpr int num_planes = 2;
+
+        static constexpr int plane_bytes(int plane) { return plane ? 4 : 2; }
+        static constexpr int plane_hshift(int plane) { return plane ? 1 : 0; }
+    };
+
+    //--------------------------------------------------------------------------
+    // Image view: non-owning pointers to planes, size and strides
+
+    template <typename Format, typename Byte = unsigned char>
+    class image_view
+    {
+        static_assert(std::is_base_of<format_tag, Format>::value,
+            "Format should be one of secam:: pixel format tags");
+
+        static constexpr int num_planes = Format::num_planes;
+
+    public:
+        using format = Format;
+
+        /**
+         * View of a format with one plane. Stride is the distance between
+         * rows in bytes, zero means rows are tightly packed.
+         */
+        template <typename F = Format,
+            typename std::enable_if<F::num_planes == 1, int>::type = 0>
+        image_view(Byte *data, int width, int height, std::ptrdiff_t stride = 0) noexcept
+            : planes_()
+            , strides_()
+            , width_(width)
+            , height_(height)
+        {
+            planes_[0] = data;
+            strides_[0] = stride ? stride : default_stride(0, width);
+        }
+
+        /**
+         * View of a planar format, planes are passed as e.g. { y, u, v }.
+         * Zero stride of a plane means its rows are tightly packed.
+         */
+        template <typename F = Format,
+            typename std::enable_if<(F::num_planes > 1), int>::type = 0>
+        image_view(Byte *const (&planes)[F::num_planes], int width, int height) noexcept
+            : planes_()
+            , strides_()
+            , width_(width)
+            , height_(height)
+        {
+            for (int i = 0; i < num_planes; i++) {
+                planes_[i] = planes[i];
+                strides_[i] = default_stride(i, width);
+            }
+        }
+
+        template <typename F = Format,
+            typename std::enable_if<(F::num_planes > 1), int>::type = 0>
+        image_view(Byte *const (&planes)[F::num_planes], int width, int height,
+            std::ptrdiff_t const (&strides)[F::num_planes]) noexcept
+            : planes_()
+            , strides_()
+            , width_(width)
+            , height_(height)
+        {
+            for (int i = 0; i < num_planes; i++) {
+                planes_[i] = planes[i];
+                strides_[i] = strides[i] ? strides[i] : default_stride(i, width);
+            }
+        }
+
+        /**
+         * Mutable view converts to read-only one.
+         */
+        template <typename OtherByte,
+            typename = typename std::enable_if<std::is_convertible<OtherByte *, Byte *>::value>::type>
+        image_view(image_view<Format, OtherByte> const &other) noexcept
+            : planes_()
+            , strides_()
+            , width_(other.width())
+            , height_(other.height())
+        {
+            for (int i = 0; i < num_planes; i++) {
+                planes_[i] = other.data(i);
+                strides_[i] = other.stride(i);
+            }
+        }
+
+        Byte *data(int plane = 0) const noexcept { return planes_[plane]; }
+        int width() const noexcept { return width_; }
+        int height() const noexcept { return height_; }
+        std::ptrdiff_t stride(int plane = 0) const noexcept { return strides_[plane]; }
+
+        /**
+         * Row of a plane, chroma planes of 4:2:0 formats have half as many.
+         */
+        Byte *row(int y, int plane = 0) const noexcept
+        {
+            return planes_[plane] + strides_[plane] * y;
+        }
+
+        /**
+         * Describe the view for C interface.
+         */
+        libsecam_image_t image() const noexcept
+        {
+            libsecam_image_t image = {};
+
+            image.format = Format::id;
+
+            for (int i = 0; i < num_planes; i++) {
+                image.planes[i] = const_cast<unsigned char *>(planes_[i]);
+                image.pitches[i] = static_cast<int>(strides_[i]);
+            }
+
+            return image;
+        }
+
+    private:
+        static std::ptrdiff_t default_stride(int plane, int width) noexcept
+        {
+            return static_cast<std::ptrdiff_t>(width >> Format::plane_hshift(plane))
+                * Format::plane_bytes(plane);
+        }
+
+        Byte *planes_[3];
+        std::ptrdiff_t strides_[3];
+        int width_;
+        int height_;
+    };
+
+    template <typename Format>
+    using const_image_view = image_view<Format, unsigned char const>;
+
+    //--------------------------------------------------------------------------
+    // Engine: worker pool shared by several filters
+
+    class engine
+    {
+    public:
+        /**
+         * Zero threads means one per CPU.
+         */
+        explicit engine(int num_threads = 0)
+            : handle_(libsecam_engine_init(num_threads))
+        {
+            if (!handle_) {
+                throw std::bad_alloc();
+            }
+        }
+
+        ~engine()
+        {
+            if (handle_) {
+                libsecam_engine_close(handle_);
+            }
+        }
+
+        engine(engine &&other) noexcept
+            : handle_(other.handle_)
+        {
+            other.handle_ = nullptr;
+        }
+
+        engine &operator=(engine &&other) noexcept
+        {
+            if (this != &other) {
+                if (handle_) {
+                    libsecam_engine_close(handle_);
+                }
+
+                handle_ = other.handle_;
+                other.handle_ = nullptr;
+            }
+
+            return *this;
+        }
+
+        engine(engine const &) = delete;
+        engine &operator=(engine const &) = delete;
+
+        libsecam_engine_t *get() const noexcept { return handle_; }
+
+    private:
+        libsecam_engine_t *handle_;
+    };
+
+    //--------------------------------------------------------------------------
+    // Scratch: line buffers of one host thread, see filter::filter_rows()
+
+    class scratch
+    {
+    public:
+        scratch()
+            : handle_(libsecam_scratch_init())
+        {
+            if (!handle_) {
+                throw std::bad_alloc();
+            }
+        }
+
+        ~scratch()
+        {
+            if (handle_) {
+                libsecam_scratch_close(handle_);
+            }
+        }
+
+        scratch(scratch &&other) noexcept
+            : handle_(other.handle_)
+        {
+            other.handle_ = nullptr;
+        }
+
+        scratch &operator=(scratch &&other) noexcept
+        {
+            if (this != &other) {
+                if (handle_) {
+                    libsecam_scratch_close(handle_);
+                }
+
+                handle_ = other.handle_;
+                other.handle_ = nullptr;
+            }
+
+            return *this;
+        }
+
+        scratch(scratch const &) = delete;
+        scratch &operator=(scratch const &) = delete;
+
+        libsecam_scratch_t *get() const noexcept { return handle_; }
+
+    private:
+        libsecam_scratch_t *handle_;
+    };
+
+    //--------------------------------------------------------------------------
+    // Filter
+
+    class filter
+    {
+    public:
+        /**
+         * Filter with its own worker threads.
+         */
+        filter(int width, int height)
+            : handle_(libsecam_init(width, height))
+            , width_(width)
+            , height_(height)
+        {
+            if (!handle_) {
+                throw std::bad_alloc();
+            }
+        }
+
+        /**
+         * Filter using worker threads of the engine.
+         * The engine should outlive the filter.
+         */
+        filter(engine &pool, int width, int height)
+            : handle_(libsecam_init_shared(pool.get(), width, height))
+            , width_(width)
+            , height_(height)
+        {
+            if (!handle_) {
+                throw std::bad_alloc();
+            }
+        }
+
+        ~filter()
+        {
+            if (handle_) {
+                libsecam_close(handle_);
+            }
+        }
+
+        filter(filter &&other) noexcept
+            : handle_(other.handle_)
+            , width_(other.width_)
+            , height_(other.height_)
+        {
+            other.handle_ = nullptr;
+        }
+
+        filter &operator=(filter &&other) noexcept
+        {
+            if (this != &other) {
+                if (handle_) {
+                    libsecam_close(handle_);
+                }
+
+                handle_ = other.handle_;
+                width_ = other.width_;
+                height_ = other.height_;
+                other.handle_ = nullptr;
+            }
+
+            return *this;
+        }
+
+        filter(filter const &) = delete;
+        filter &operator=(filter const &) = delete;
+
+        libsecam_t *get() const noexcept { return handle_; }
+        int width() const noexcept { return width_; }
+        int height() const noexcept { return height_; }
+
+        libsecam_options_t &options() noexcept
+        {
+            return *libsecam_options(handle_);
+        }
+
+        void set_threads(int num_threads) noexcept
+        {
+            libsecam_set_threads(handle_, num_threads);
+        }
+
+        void seed(unsigned int seed) noexcept
+        {
+            libsecam_seed(handle_, seed);
+        }
+
+        /**
+         * Pick the best band count, keeping results in the wisdom file
+         * if one is given. Returns the band count.
+         */
+        int autotune(char const *wisdom_path = nullptr)
+        {
+            int bands = libsecam_autotune(handle_, wisdom_path);
+
+            if (bands == 0) {
+                throw std::bad_alloc();
+            }
+
+            return bands;
+        }
+
+        /**
+         * Change frame size, keeping options and random state.
+         */
+        void resize(int width, int height)
+        {
+            if (!libsecam_resize(handle_, width, height)) {
+                throw std::bad_alloc();
+            }
+
+            width_ = width;
+            height_ = height;
+        }
+
+        /**
+         * Lower quality when frames come close to the deadline,
+         * zero turns it off.
+         */
+        void set_deadline(double milliseconds) noexcept
+        {
+            libsecam_set_deadline(handle_, milliseconds);
+        }
+
+        libsecam_governor_stats_t const &governor_stats() const noexcept
+        {
+            return *libsecam_governor_stats(handle_);
+        }
+
+        void hint_unchanged() noexcept
+        {
+            libsecam_hint_unchanged(handle_);
+        }
+
+        /**
+         * Filter one frame. Both images should be of the filter's size.
+         * Throws std::bad_alloc if some rows couldn't be filtered.
+         */
+        template <typename SrcFormat, typename DstFormat>
+        void process(const_image_view<SrcFormat> src, image_view<DstFormat> dst)
+        {
+            check_size(src.width(), src.height());
+            check_size(dst.width(), dst.height());
+
+            libsecam_image_t const src_image = src.image();
+            libsecam_image_t const dst_image = dst.image();
+
+            if (!libsecam_filter_image(handle_, &src_image, &dst_image)) {
+                throw std::bad_alloc();
+            }
+        }
+
+        /**
+         * Allow passing mutable source view.
+         */
+        template <typename SrcFormat, typename DstFormat>
+        void process(image_view<SrcFormat> src, image_view<DstFormat> dst)
+        {
+            process(const_image_view<SrcFormat>(src), dst);
+        }
+
+        /**
+         * Prepare a frame for filter_rows().
+         */
+        template <typename SrcFormat>
+        void begin_frame(const_image_view<SrcFormat> src)
+        {
+            check_size(src.width(), src.height());
+
+            libsecam_image_t const src_image = src.image();
+
+            libsecam_begin_image(handle_, &src_image);
+        }
+
+        /**
+         * Filter rows y0 to y1 of the frame passed to begin_frame().
+         * May be called from several threads at once for different rows,
+         * each thread with its own scratch.
+         */
+        template <typename SrcFormat, typename DstFormat>
+        void filter_rows(int y0, int y1, const_image_view<SrcFormat> src,
+            image_view<DstFormat> dst, scratch &buffers)
+        {
+            check_size(src.width(), src.height());
+            check_size(dst.width(), dst.height());
+
+            libsecam_image_t const src_image = src.image();
+            libsecam_image_t const dst_image = dst.image();
+
+            libsecam_filter_image_rows(handle_, y0, y1, &src_image, &dst_image, buffers.get());
+        }
+
+    private:
+        void check_size(int width, int height) const
+        {
+            if (width != width_ || height != height_) {
+                throw std::invalid_argument("secam::filter: image size mismatch");
+            }
+        }
+
+        libsecam_t *handle_;
+        int width_;
+        int height_;
+    };
+}
+
+//------------------------------------------------------------------------------
+
+#endif // TUORQAI_LIBSECAM_HPP
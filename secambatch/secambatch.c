@@ -0,0 +1,346 @@
+//------------------------------------------------------------------------------
+// cc -O2 -pthread -DLIBSECAM_USE_THREADS -o secambatch secambatch.c -lm
+//------------------------------------------------------------------------------
+// Usage:
+// ./secambatch -W 720 -H 576 input.raw output.raw
+//
+// Options:
+// -W N, -H N   frame size, required
+// -n N         number of frames, default is as many as input has
+// -j N         frames filtered at once (default 2)
+// -t N         worker threads, 0 is one per CPU (default)
+// -s SEED      random seed
+// -T FILE      pick band count for this machine, keep the result in FILE
+// -N on|off    force non-temporal stores of output on or off, default is
+//              on for frames larger than the last level cache
+//------------------------------------------------------------------------------
+// Filters raw sequence of XRGB frames. Both files are memory-mapped, frames
+// are read from one mapping and written straight into another, without any
+// intermediate buffers. Output file is created or truncated.
+//
+// Each of the -j jobs has its own libsecam instance, all of them share one
+// engine, so bands of several frames are processed at the same time.
+// Every frame is seeded with its number, so the output depends on the number
+// of worker threads (which is the number of bands), but not on the number
+// of jobs.
+//
+// When done, prints throughput along with memcpy() throughput measured on
+// the same amount of memory, which is the practical upper limit. Running
+// with -N on and -N off compares output written past the cache with output
+// written through it.
+//------------------------------------------------------------------------------
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LIBSECAM_IMPLEMENTATION
+#include "../libsecam.h"
+
+//------------------------------------------------------------------------------
+
+struct job
+{
+    pthread_t thread;
+    libsecam_t *libsecam;
+};
+
+static int width = 0;
+static int height = 0;
+static int num_frames = 0;
+static unsigned int seed = 0;
+static char const *wisdom_path = NULL;
+static int nontemporal = -1;        // -1 if not forced
+static size_t frame_size;
+
+static unsigned char const *input;
+static unsigned char *output;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int next_frame = 0;
+static bool failed = false;
+
+//------------------------------------------------------------------------------
+
+static double get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *job_main(void *arg)
+{
+    struct job *job = (struct job *) arg;
+
+    while (true) {
+        pthread_mutex_lock(&mutex);
+        int frame = next_frame++;
+        pthread_mutex_unlock(&mutex);
+
+        if (frame >= num_frames) {
+            break;
+        }
+
+        size_t offset = frame_size * frame;
+
+        libsecam_seed(job->libsecam, seed + frame);
+
+        if (!libsecam_filter_to_buffer(job->libsecam, input + offset, output + offset)) {
+            pthread_mutex_lock(&mutex);
+            failed = true;
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Measure how fast memory of the given size can be copied.
+ */
+static double measure_memcpy(size_t size)
+{
+    // Large enough to get out of caches, small enough to fit anywhere.
+    size_t const limit = (size_t) 512 << 20;
+
+    if (size > limit) {
+        size = limit;
+    }
+
+    unsigned char *a = malloc(size);
+    unsigned char *b = malloc(size);
+
+    if (!a || !b) {
+        free(a);
+        free(b);
+        return 0.0;
+    }
+
+    // Touch the pages first, so page faults aren't measured.
+    memset(a, 1, size);
+    memset(b, 2, size);
+
+    double best = 0.0;
+
+    for (int i = 0; i < 3; i++) {
+        double start = get_time();
+        memcpy(b, a, size);
+        double elapsed = get_time() - start;
+
+        if (elapsed > 0.0 && size / elapsed > best) {
+            best = size / elapsed;
+        }
+    }
+
+    free(a);
+    free(b);
+
+    return best;
+}
+
+static int usage(char const *name)
+{
+    fprintf(stderr, "usage: %s -W width -H height [-n frames] [-j jobs] "
+        "[-t threads] [-s seed] [-T wisdom] [-N on|off] input.raw output.raw\n", name);
+    return EXIT_FAILURE;
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    int num_jobs = 2;
+    int num_threads = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "W:H:n:j:t:s:T:N:")) != -1) {
+        switch (opt) {
+        case 'W':
+            width = atoi(optarg);
+            break;
+        case 'H':
+            height = atoi(optarg);
+            break;
+        case 'n':
+            num_frames = atoi(optarg);
+            break;
+        case 'j':
+            num_jobs = atoi(optarg);
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 's':
+            seed = (unsigned int) strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            wisdom_path = optarg;
+            break;
+        case 'N':
+            if (strcmp(optarg, "on") == 0) {
+                nontemporal = 1;
+            } else if (strcmp(optarg, "off") == 0) {
+                nontemporal = 0;
+            } else {
+                return usage(argv[0]);
+            }
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+
+    if (width <= 0 || height <= 0 || argc - optind != 2) {
+        return usage(argv[0]);
+    }
+
+    if (num_jobs < 1) {
+        num_jobs = 1;
+    }
+
+    frame_size = (size_t) width * height * 4;
+
+    int in_fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+
+    if (in_fd < 0 || fstat(in_fd, &st) < 0) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    int available = (int) (st.st_size / frame_size);
+
+    if (num_frames <= 0 || num_frames > available) {
+        num_frames = available;
+    }
+
+    if (num_frames == 0) {
+        fprintf(stderr, "secambatch: input has no complete frames\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t total_size = frame_size * num_frames;
+
+    int out_fd = open(argv[optind + 1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (out_fd < 0) {
+        perror(argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+
+    // Allocate the whole output up front, so writing to the mapping
+    // can't fail halfway with SIGBUS when the disk is full.
+    int error = posix_fallocate(out_fd, 0, (off_t) total_size);
+
+    if (error) {
+        fprintf(stderr, "secambatch: can't allocate output: %s\n", strerror(error));
+        return EXIT_FAILURE;
+    }
+
+    input = mmap(NULL, total_size, PROT_READ, MAP_SHARED, in_fd, 0);
+    output = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+
+    if (input == MAP_FAILED || output == MAP_FAILED) {
+        perror("secambatch: mmap");
+        return EXIT_FAILURE;
+    }
+
+    // Frames are taken in order, so read-ahead helps and pages behind
+    // can be dropped early.
+    madvise((void *) input, total_size, MADV_SEQUENTIAL);
+    madvise(output, total_size, MADV_SEQUENTIAL);
+
+    libsecam_engine_t *engine = libsecam_engine_init(num_threads);
+
+    if (!engine) {
+        fprintf(stderr, "secambatch: failed to start worker threads\n");
+        return EXIT_FAILURE;
+    }
+
+    struct job *jobs = calloc(num_jobs, sizeof(*jobs));
+
+    if (!jobs) {
+        fprintf(stderr, "secambatch: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < num_jobs; i++) {
+        jobs[i].libsecam = libsecam_init_shared(engine, width, height);
+
+        if (!jobs[i].libsecam) {
+            fprintf(stderr, "secambatch: failed to initialize libsecam\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Tuned alone, though jobs share the engine, so bands of one frame
+    // compete with those of others. The first job measures, the rest
+    // take its results from the file.
+    if (wisdom_path) {
+        int bands = libsecam_autotune(jobs[0].libsecam, wisdom_path);
+
+        for (int i = 1; i < num_jobs && bands > 0; i++) {
+            libsecam_autotune(jobs[i].libsecam, wisdom_path);
+        }
+
+        fprintf(stderr, "secambatch: %d bands per frame\n", bands);
+    }
+
+    // Forced store kind overrides the tuned one.
+    for (int i = 0; i < num_jobs && nontemporal >= 0; i++) {
+        libsecam_set_nontemporal_threshold(jobs[i].libsecam, nontemporal ? 0 : (size_t) -1);
+    }
+
+    double start = get_time();
+
+    for (int i = 0; i < num_jobs; i++) {
+        pthread_create(&jobs[i].thread, NULL, job_main, &jobs[i]);
+    }
+
+    for (int i = 0; i < num_jobs; i++) {
+        pthread_join(jobs[i].thread, NULL);
+    }
+
+    double elapsed = get_time() - start;
+
+    for (int i = 0; i < num_jobs; i++) {
+        libsecam_close(jobs[i].libsecam);
+    }
+
+    free(jobs);
+    libsecam_engine_close(engine);
+
+    munmap((void *) input, total_size);
+    munmap(output, total_size);
+    close(in_fd);
+    close(out_fd);
+
+    if (failed) {
+        fprintf(stderr, "secambatch: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    // Both are counted as bytes copied from one place to another.
+    double filter_rate = total_size / elapsed;
+    double memcpy_rate = measure_memcpy(total_size);
+
+    fprintf(stderr, "secambatch: %d frames in %.2f s, %.1f fps\n",
+        num_frames, elapsed, num_frames / elapsed);
+    fprintf(stderr, "secambatch: %.2f GB/s, memcpy: %.2f GB/s (%.1f%%)\n",
+        filter_rate / 1e9, memcpy_rate / 1e9,
+        memcpy_rate > 0.0 ? 100.0 * filter_rate / memcpy_rate : 0.0);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,554 @@
+//------------------------------------------------------------------------------
+// cc -O2 -pthread -DLIBSECAM_USE_THREADS -o secamify secamify.c -lm
+//------------------------------------------------------------------------------
+// Usage:
+// ffmpeg -i in.mp4 -f yuv4mpegpipe - | ./secamify | ffmpeg -i - out.mp4
+//
+// Options:
+// -t N         worker threads, 0 is one per CPU (default)
+// -s SEED      random seed
+// -r N         frames in flight between reader, filter and writer (default 4)
+// -l, -c, -f   luma noise, chroma noise, chroma fire
+// -e, -k, -w   echo, skew, wobble
+// -a           take noise from precomputed tables (faster)
+// -d MS        frame deadline, quality is lowered when frames come close to it
+// -T FILE      pick band count for this machine, keep the result in FILE
+// -q           don't print progress
+//------------------------------------------------------------------------------
+// Reads YUV4MPEG2 stream from stdin and writes filtered one to stdout.
+// Only 8-bit 4:2:0 and 4:4:4 streams are accepted, frames are filtered in their
+// native planar format. Reading, filtering and writing run on separate
+// threads, passing frames through a ring of buffers.
+//
+// With -d, every change of quality is reported along with the frame time
+// which caused it, and the number of late frames is printed at the end.
+//------------------------------------------------------------------------------
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LIBSECAM_IMPLEMENTATION
+#include "../libsecam.h"
+
+//------------------------------------------------------------------------------
+
+enum slot_state
+{
+    SLOT_FREE,                  // waiting for the reader
+    SLOT_READ,                  // waiting for the filter
+    SLOT_FILTERED,              // waiting for the writer
+};
+
+struct slot
+{
+    enum slot_state state;
+    unsigned char *src;
+    unsigned char *dst;
+};
+
+struct stream
+{
+    int width;
+    int height;
+    libsecam_format_t format;
+    int chroma_width;
+    int chroma_height;
+    size_t frame_size;
+};
+
+static struct stream stream;
+static struct slot *ring;
+static int ring_size = 4;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static int frames_read = 0;
+static int frames_written = 0;
+static bool end_of_input = false;
+static bool bad_input = false;      // frames before the bad one are still written
+static bool failed = false;
+
+//------------------------------------------------------------------------------
+
+static double get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Read one header line, without the newline.
+ */
+static bool read_line(char *line, size_t size)
+{
+    size_t length = 0;
+    int c;
+
+    while ((c = getchar()) != EOF && c != '\n') {
+        if (length + 1 < size) {
+            line[length++] = (char) c;
+        }
+    }
+
+    line[length] = '\0';
+
+    return c == '\n';
+}
+
+/**
+ * Take format from colorspace parameter, e.g. "C420jpeg". Variants of 4:2:0
+ * differ only in chroma siting, which the filter doesn't care about.
+ */
+static bool parse_colorspace(char const *param, size_t length)
+{
+    static char const *const names_420[] = { "C420", "C420jpeg", "C420paldv", "C420mpeg2" };
+
+    for (size_t i = 0; i < sizeof(names_420) / sizeof(names_420[0]); i++) {
+        if (strlen(names_420[i]) == length && strncmp(param, names_420[i], length) == 0) {
+            stream.format = LIBSECAM_FORMAT_YUV420P;
+            return true;
+        }
+    }
+
+    if (length == 4 && strncmp(param, "C444", 4) == 0) {
+        stream.format = LIBSECAM_FORMAT_YUV444P;
+        return true;
+    }
+
+    // High bit depths are named like C420p10 or C444p12.
+    if (length > 5 && param[4] == 'p' && param[5] >= '0' && param[5] <= '9') {
+        fprintf(stderr, "secamify: colorspace %.*s is not 8-bit\n", (int) length, param);
+    } else {
+        fprintf(stderr, "secamify: unsupported colorspace %.*s\n", (int) length, param);
+    }
+
+    return false;
+}
+
+/**
+ * Parse stream header, see https://wiki.multimedia.cx/index.php/YUV4MPEG2
+ */
+static bool parse_header(char const *header)
+{
+    if (strncmp(header, "YUV4MPEG2", 9) != 0) {
+        fprintf(stderr, "secamify: input is not YUV4MPEG2\n");
+        return false;
+    }
+
+    stream.width = 0;
+    stream.height = 0;
+    stream.format = LIBSECAM_FORMAT_YUV420P;
+
+    for (char const *p = strchr(header, ' '); p; p = strchr(p, ' ')) {
+        p++;
+
+        if (*p == 'W') {
+            stream.width = atoi(p + 1);
+        } else if (*p == 'H') {
+            stream.height = atoi(p + 1);
+        } else if (*p == 'C') {
+            if (!parse_colorspace(p, strcspn(p, " \n"))) {
+                return false;
+            }
+        }
+    }
+
+    if (stream.width <= 0 || stream.height <= 0) {
+        fprintf(stderr, "secamify: no frame size in stream header\n");
+        return false;
+    }
+
+    if (stream.format == LIBSECAM_FORMAT_YUV420P) {
+        if ((stream.width % 2) || (stream.height % 2)) {
+            fprintf(stderr, "secamify: 4:2:0 frame size should be even\n");
+            return false;
+        }
+
+        stream.chroma_width = stream.width / 2;
+        stream.chroma_height = stream.height / 2;
+    } else {
+        stream.chroma_width = stream.width;
+        stream.chroma_height = stream.height;
+    }
+
+    stream.frame_size = (size_t) stream.width * stream.height
+        + (size_t) stream.chroma_width * stream.chroma_height * 2;
+
+    return true;
+}
+
+static libsecam_image_t describe_frame(unsigned char *data)
+{
+    libsecam_image_t image;
+    size_t luma_size = (size_t) stream.width * stream.height;
+    size_t chroma_size = (size_t) stream.chroma_width * stream.chroma_height;
+
+    image.format = stream.format;
+    image.planes[0] = data;
+    image.planes[1] = data + luma_size;
+    image.planes[2] = data + luma_size + chroma_size;
+    image.pitches[0] = stream.width;
+    image.pitches[1] = stream.chroma_width;
+    image.pitches[2] = stream.chroma_width;
+
+    return image;
+}
+
+static void report_quality(void *user, libsecam_governor_stats_t const *stats,
+    libsecam_quality_t previous)
+{
+    static char const *names[LIBSECAM_TOTAL_QUALITY_LEVELS] = {
+        "full", "fast noise", "short loss", "half lines",
+    };
+
+    (void) user;
+
+    fprintf(stderr, "\rsecamify: frame %d took %.1f ms, quality %s -> %s\n",
+        stats->frames, stats->last_ms, names[previous], names[stats->quality]);
+}
+
+//------------------------------------------------------------------------------
+
+static void *reader_main(void *arg)
+{
+    char line[256];
+
+    (void) arg;
+
+    for (int i = 0; ; i++) {
+        struct slot *slot = &ring[i % ring_size];
+
+        pthread_mutex_lock(&mutex);
+
+        while (slot->state != SLOT_FREE && !failed) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+
+        bool done = failed;
+
+        pthread_mutex_unlock(&mutex);
+
+        if (done) {
+            break;
+        }
+
+        // Frame parameters, if there are any, are dropped.
+        // Input may only end right before a frame header.
+        char const *error = NULL;
+        bool ended = false;
+
+        if (!read_line(line, sizeof(line))) {
+            if (ferror(stdin)) {
+                error = "failed to read input";
+            } else if (line[0]) {
+                error = "truncated frame header";
+            } else {
+                ended = true;
+            }
+        } else if (strncmp(line, "FRAME", 5) != 0 || (line[5] != '\0' && line[5] != ' ')) {
+            error = "expected frame header";
+        } else if (fread(slot->src, 1, stream.frame_size, stdin) != stream.frame_size) {
+            error = ferror(stdin) ? "failed to read input" : "truncated frame";
+        }
+
+        bool ok = !error && !ended;
+
+        pthread_mutex_lock(&mutex);
+
+        if (ok) {
+            slot->state = SLOT_READ;
+            frames_read++;
+        } else {
+            if (error) {
+                fprintf(stderr, "secamify: frame %d: %s\n", i + 1, error);
+                bad_input = true;
+            }
+
+            end_of_input = true;
+        }
+
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+
+        if (!ok) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void *writer_main(void *arg)
+{
+    (void) arg;
+
+    for (int i = 0; ; i++) {
+        struct slot *slot = &ring[i % ring_size];
+
+        pthread_mutex_lock(&mutex);
+
+        while (slot->state != SLOT_FILTERED && !failed
+            && !(end_of_input && i == frames_read)) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+
+        bool done = failed || (slot->state != SLOT_FILTERED);
+
+        pthread_mutex_unlock(&mutex);
+
+        if (done) {
+            break;
+        }
+
+        bool ok = fputs("FRAME\n", stdout) >= 0
+            && fwrite(slot->dst, 1, stream.frame_size, stdout) == stream.frame_size;
+
+        pthread_mutex_lock(&mutex);
+
+        if (ok) {
+            slot->state = SLOT_FREE;
+            frames_written++;
+        } else {
+            fprintf(stderr, "secamify: failed to write output\n");
+            failed = true;
+        }
+
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    fflush(stdout);
+
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    int num_threads = 0;
+    unsigned int seed = 0;
+    bool has_seed = false;
+    bool quiet = false;
+    double deadline = 0.0;
+    char const *wisdom_path = NULL;
+
+    libsecam_options_t options = {
+        LIBSECAM_DEFAULT_LUMA_NOISE,
+        LIBSECAM_DEFAULT_CHROMA_NOISE,
+        LIBSECAM_DEFAULT_CHROMA_FIRE,
+        LIBSECAM_DEFAULT_ECHO,
+        LIBSECAM_DEFAULT_SKEW,
+        LIBSECAM_DEFAULT_WOBBLE,
+        false,
+        false,
+    };
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:s:r:l:c:f:e:k:w:ad:T:q")) != -1) {
+        switch (opt) {
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 's':
+            seed = (unsigned int) strtoul(optarg, NULL, 0);
+            has_seed = true;
+            break;
+        case 'r':
+            ring_size = atoi(optarg);
+            break;
+        case 'l':
+            options.luma_noise = atof(optarg);
+            break;
+        case 'c':
+            options.chroma_noise = atof(optarg);
+            break;
+        case 'f':
+            options.chroma_fire = atof(optarg);
+            break;
+        case 'e':
+            options.echo = atoi(optarg);
+            break;
+        case 'k':
+            options.skew = atoi(optarg);
+            break;
+        case 'w':
+            options.wobble = atoi(optarg);
+            break;
+        case 'a':
+            options.noise_atlas = true;
+            break;
+        case 'd':
+            deadline = atof(optarg);
+            break;
+        case 'T':
+            wisdom_path = optarg;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-s seed] [-r ring size] "
+                "[-l luma noise] [-c chroma noise] [-f chroma fire] "
+                "[-e echo] [-k skew] [-w wobble] [-a] [-d deadline ms] [-T wisdom] [-q] "
+                "< in.y4m > out.y4m\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (ring_size < 2) {
+        ring_size = 2;
+    }
+
+    char header[1024];
+
+    if (!read_line(header, sizeof(header)) || !parse_header(header)) {
+        return EXIT_FAILURE;
+    }
+
+    // Stream parameters don't change, so the header is passed as is.
+    printf("%s\n", header);
+
+    libsecam_engine_t *engine = libsecam_engine_init(num_threads);
+
+    if (!engine) {
+        fprintf(stderr, "secamify: failed to start worker threads\n");
+        return EXIT_FAILURE;
+    }
+
+    libsecam_t *libsecam = libsecam_init_shared(engine, stream.width, stream.height);
+
+    if (!libsecam) {
+        fprintf(stderr, "secamify: failed to initialize libsecam\n");
+        libsecam_engine_close(engine);
+        return EXIT_FAILURE;
+    }
+
+    *libsecam_options(libsecam) = options;
+
+    if (has_seed) {
+        libsecam_seed(libsecam, seed);
+    }
+
+    if (wisdom_path) {
+        int bands = libsecam_autotune(libsecam, wisdom_path);
+
+        if (!quiet && bands > 0) {
+            fprintf(stderr, "secamify: %d bands per frame\n", bands);
+        }
+    }
+
+    if (deadline > 0.0) {
+        libsecam_set_deadline(libsecam, deadline);
+        libsecam_set_governor_callback(libsecam, report_quality, NULL);
+    }
+
+    ring = calloc(ring_size, sizeof(*ring));
+
+    if (!ring) {
+        fprintf(stderr, "secamify: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < ring_size; i++) {
+        ring[i].state = SLOT_FREE;
+        ring[i].src = malloc(stream.frame_size);
+        ring[i].dst = malloc(stream.frame_size);
+
+        if (!ring[i].src || !ring[i].dst) {
+            fprintf(stderr, "secamify: out of memory\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    pthread_t reader, writer;
+
+    pthread_create(&reader, NULL, reader_main, NULL);
+    pthread_create(&writer, NULL, writer_main, NULL);
+
+    double start_time = get_time();
+    double report_time = start_time;
+
+    for (int i = 0; ; i++) {
+        struct slot *slot = &ring[i % ring_size];
+
+        pthread_mutex_lock(&mutex);
+
+        while (slot->state != SLOT_READ && !failed
+            && !(end_of_input && i == frames_read)) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+
+        bool done = failed || (slot->state != SLOT_READ);
+
+        pthread_mutex_unlock(&mutex);
+
+        if (done) {
+            break;
+        }
+
+        libsecam_image_t src = describe_frame(slot->src);
+        libsecam_image_t dst = describe_frame(slot->dst);
+
+        bool filtered = libsecam_filter_image(libsecam, &src, &dst);
+
+        pthread_mutex_lock(&mutex);
+
+        if (!filtered) {
+            fprintf(stderr, "secamify: out of memory\n");
+            failed = true;
+        }
+
+        slot->state = SLOT_FILTERED;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+
+        double now = get_time();
+
+        if (!quiet && now - report_time >= 1.0) {
+            fprintf(stderr, "\rsecamify: %d frames, %.1f fps ",
+                i + 1, (i + 1) / (now - start_time));
+            report_time = now;
+        }
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+
+    double elapsed = get_time() - start_time;
+
+    if (!quiet) {
+        fprintf(stderr, "\rsecamify: %d frames in %.2f s, %.1f fps, %.1f MB/s\n",
+            frames_written, elapsed, frames_written / elapsed,
+            frames_written * (double) stream.frame_size / elapsed / 1e6);
+    }
+
+    if (deadline > 0.0) {
+        libsecam_governor_stats_t const *stats = libsecam_governor_stats(libsecam);
+
+        fprintf(stderr, "secamify: %d of %d frames late, worst %.1f ms, "
+            "quality lowered %d times\n", stats->missed, stats->frames,
+            stats->worst_ms, stats->degrades);
+    }
+
+    for (int i = 0; i < ring_size; i++) {
+        free(ring[i].src);
+        free(ring[i].dst);
+    }
+
+    free(ring);
+
+    libsecam_close(libsecam);
+    libsecam_engine_close(engine);
+
+    return (failed || bad_input) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
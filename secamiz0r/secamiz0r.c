@@ -2,22 +2,56 @@
 // #define ENABLE_TIME_TEST
 #define LIBSECAM_IMPLEMENTATION
 
+#include <math.h>
+#include <stdlib.h>
+
 #include "frei0r.h"
 #include "libsecam.h"
 
+enum param
+{
+    PARAM_INTENSITY,
+    PARAM_THREADS,
+    PARAM_SEED,
+    PARAM_LUMA_NOISE,
+    PARAM_CHROMA_NOISE,
+    PARAM_CHROMA_FIRE,
+    PARAM_ECHO,
+    PARAM_SKEW,
+    PARAM_WOBBLE,
+    TOTAL_PARAMS,
+};
+
+// Raw libsecam options, negative value means "derive from intensity".
+#define FIRST_RAW_PARAM PARAM_LUMA_NOISE
+#define TOTAL_RAW_PARAMS (TOTAL_PARAMS - FIRST_RAW_PARAM)
+
 struct secamiz0r
 {
     libsecam_t *libsecam;
     unsigned int width;
     unsigned int height;
     double intensity;
+    double threads;
+    double seed;
+    double raw[TOTAL_RAW_PARAMS];
 };
 
-static void update_libsecam_options(libsecam_t *libsecam, double intensity)
+// One worker pool for all instances, so that several filter chains running
+// in one process don't fight over CPU cores.
+// Its size is taken from SECAMIZ0R_THREADS environment variable,
+// by default there is one thread per CPU.
+// Some hosts call f0r_init() and f0r_deinit() once per filter instance,
+// so the engine is created by the first call and closed by the last one.
+static libsecam_engine_t *engine = NULL;
+static int engine_users = 0;
+
+static void update_libsecam_options(struct secamiz0r *secamiz0r)
 {
-    libsecam_options_t *options = libsecam_options(libsecam);
+    libsecam_options_t *options = libsecam_options(secamiz0r->libsecam);
+    double const *raw = secamiz0r->raw;
 
-    double const x = intensity;
+    double const x = secamiz0r->intensity;
     double const xs = x * x;
 
     options->luma_noise = 0.05 + (0.95 * xs);
@@ -26,15 +60,59 @@ static void update_libsecam_options(libsecam_t *libsecam, double intensity)
     options->echo = (int) ceilf(6.0 * x);
     options->skew = options->echo / 2;
     options->wobble = options->echo / 2;
+
+    if (raw[PARAM_LUMA_NOISE - FIRST_RAW_PARAM] >= 0.0) {
+        options->luma_noise = raw[PARAM_LUMA_NOISE - FIRST_RAW_PARAM];
+    }
+
+    if (raw[PARAM_CHROMA_NOISE - FIRST_RAW_PARAM] >= 0.0) {
+        options->chroma_noise = raw[PARAM_CHROMA_NOISE - FIRST_RAW_PARAM];
+    }
+
+    if (raw[PARAM_CHROMA_FIRE - FIRST_RAW_PARAM] >= 0.0) {
+        options->chroma_fire = raw[PARAM_CHROMA_FIRE - FIRST_RAW_PARAM];
+    }
+
+    if (raw[PARAM_ECHO - FIRST_RAW_PARAM] >= 0.0) {
+        options->echo = (int) raw[PARAM_ECHO - FIRST_RAW_PARAM];
+    }
+
+    if (raw[PARAM_SKEW - FIRST_RAW_PARAM] >= 0.0) {
+        options->skew = (int) raw[PARAM_SKEW - FIRST_RAW_PARAM];
+    }
+
+    if (raw[PARAM_WOBBLE - FIRST_RAW_PARAM] >= 0.0) {
+        options->wobble = (int) raw[PARAM_WOBBLE - FIRST_RAW_PARAM];
+    }
 }
 
 int f0r_init(void)
 {
+    if (engine_users == 0) {
+        char const *threads = getenv("SECAMIZ0R_THREADS");
+
+        engine = libsecam_engine_init(threads ? atoi(threads) : 0);
+
+        if (!engine) {
+            return 0;
+        }
+    }
+
+    engine_users++;
+
     return 1;
 }
 
 void f0r_deinit(void)
 {
+    if (engine_users == 0) {
+        return;
+    }
+
+    if (--engine_users == 0) {
+        libsecam_engine_close(engine);
+        engine = NULL;
+    }
 }
 
 void f0r_get_plugin_info(f0r_plugin_info_t *info)
@@ -45,19 +123,52 @@ void f0r_get_plugin_info(f0r_plugin_info_t *info)
     info->color_model = F0R_COLOR_MODEL_RGBA8888;
     info->frei0r_version = FREI0R_MAJOR_VERSION;
     info->major_version = 1;
-    info->minor_version = 0;
-    info->num_params = 1;
+    info->minor_version = 1;
+    info->num_params = TOTAL_PARAMS;
     info->explanation = "SECAM Fire effect";
 }
 
 void f0r_get_param_info(f0r_param_info_t *info, int index)
 {
+    info->type = F0R_PARAM_DOUBLE;
+
     switch (index) {
-    case 0:
+    case PARAM_INTENSITY:
         info->name = "Intensity";
-        info->type = F0R_PARAM_DOUBLE;
         info->explanation = NULL;
         break;
+    case PARAM_THREADS:
+        info->name = "Threads";
+        info->explanation = "Number of threads used by this instance, 0 to use all";
+        break;
+    case PARAM_SEED:
+        info->name = "Seed";
+        info->explanation = "Random seed, same seed gives same noise";
+        break;
+    case PARAM_LUMA_NOISE:
+        info->name = "Luma noise";
+        info->explanation = "0.0 to 1.0, negative to derive from intensity";
+        break;
+    case PARAM_CHROMA_NOISE:
+        info->name = "Chroma noise";
+        info->explanation = "0.0 to 1.0, negative to derive from intensity";
+        break;
+    case PARAM_CHROMA_FIRE:
+        info->name = "Chroma fire";
+        info->explanation = "0.0 to 1.0, negative to derive from intensity";
+        break;
+    case PARAM_ECHO:
+        info->name = "Echo";
+        info->explanation = "Echo offset in pixels, negative to derive from intensity";
+        break;
+    case PARAM_SKEW:
+        info->name = "Skew";
+        info->explanation = "Skew in pixels, negative to derive from intensity";
+        break;
+    case PARAM_WOBBLE:
+        info->name = "Wobble";
+        info->explanation = "Wobble in pixels, negative to derive from intensity";
+        break;
     default:
         break;
     }
@@ -71,7 +182,7 @@ f0r_instance_t f0r_construct(unsigned int width, unsigned int height)
         return 0;
     }
 
-    instance->libsecam = libsecam_init(width, height);
+    instance->libsecam = libsecam_init_shared(engine, width, height);
 
     if (!instance->libsecam) {
         free(instance);
@@ -81,8 +192,14 @@ f0r_instance_t f0r_construct(unsigned int width, unsigned int height)
     instance->width = width;
     instance->height = height;
     instance->intensity = 0.25;
+    instance->threads = 0.0;
+    instance->seed = LIBSECAM_DEFAULT_SEED;
 
-    update_libsecam_options(instance->libsecam, instance->intensity);
+    for (int i = 0; i < TOTAL_RAW_PARAMS; i++) {
+        instance->raw[i] = -1.0;
+    }
+
+    update_libsecam_options(instance);
 
     return instance;
 }
@@ -99,22 +216,54 @@ void f0r_set_param_value(f0r_instance_t instance, f0r_param_t param, int index)
 {
     struct secamiz0r *secamiz0r = instance;
 
+    double value = *((double *) param);
+
     switch (index) {
-    case 0:
-        secamiz0r->intensity = *((double *) param);
+    case PARAM_INTENSITY:
+        secamiz0r->intensity = value;
+        break;
+    case PARAM_THREADS:
+        secamiz0r->threads = value;
+        libsecam_set_threads(secamiz0r->libsecam, (int) value);
+        break;
+    case PARAM_SEED:
+        // Hosts may set every parameter before every frame, and reseeding
+        // restarts the noise, so only a new value is applied.
+        if (value != secamiz0r->seed) {
+            secamiz0r->seed = value;
+            libsecam_seed(secamiz0r->libsecam, (unsigned int) value);
+        }
+        break;
+    default:
+        if (index >= FIRST_RAW_PARAM && index < TOTAL_PARAMS) {
+            secamiz0r->raw[index - FIRST_RAW_PARAM] = value;
+        }
         break;
     }
 
-    update_libsecam_options(secamiz0r->libsecam, secamiz0r->intensity);
+    update_libsecam_options(secamiz0r);
 }
 
 void f0r_get_param_value(f0r_instance_t instance, f0r_param_t param, int index)
 {
     struct secamiz0r *secamiz0r = instance;
 
+    double *value = param;
+
     switch (index) {
-    case 0:
-        *((double *) param) = secamiz0r->intensity;
+    case PARAM_INTENSITY:
+        *value = secamiz0r->intensity;
+        break;
+    case PARAM_THREADS:
+        *value = secamiz0r->threads;
+        break;
+    case PARAM_SEED:
+        *value = secamiz0r->seed;
+        break;
+    default:
+        if (index >= FIRST_RAW_PARAM && index < TOTAL_PARAMS) {
+            *value = secamiz0r->raw[index - FIRST_RAW_PARAM];
+        }
         break;
     }
 }
@@ -125,7 +274,7 @@ void f0r_update(f0r_instance_t instance, double time, uint32_t const *input, uin
 
 #ifdef ENABLE_TIME_TEST
     secamiz0r->intensity = fmod(time, 10000.0) / 10000.0;
-    update_libsecam_options(secamiz0r->libsecam, secamiz0r->intensity);
+    update_libsecam_options(secamiz0r);
 #endif
 
     libsecam_filter_to_buffer(secamiz0r->libsecam,
@@ -0,0 +1,408 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2023 tuorqai
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+// libsecam_client.c: client of libsecam-server
+//
+// Connecting creates a sealed memfd with the rings and frames, and two
+// eventfd doorbells: one rung by the client when it submits a slot, one
+// by the server when a slot is done, both non-blocking, so neither side
+// can stall the other. All three are passed to the server over a Unix
+// socket, which stays open only to tell each side when the other one is
+// gone.
+//------------------------------------------------------------------------------
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "libsecam_client.h"
+
+//------------------------------------------------------------------------------
+
+struct libsecam_client
+{
+    int sock;
+    int memfd;
+    int submit_fd;
+    int done_fd;
+
+    libsecam_server_shm_t *shm;
+    size_t shm_size;
+    unsigned char *frames;
+    size_t frame_size;
+    int num_slots;
+
+    uint32_t submit_tail;
+    uint32_t done_head;
+    int pending;
+    bool busy[LIBSECAM_SERVER_MAX_SLOTS];
+};
+
+//------------------------------------------------------------------------------
+
+static size_t libsecam_client_round_page(size_t size)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    return (size + page - 1) / page * page;
+}
+
+/**
+ * Map sealed memory and fill in its header. Seals are what lets the server
+ * map memory of another process: without them, the file could be shrunk
+ * under the server, which would then crash on access.
+ */
+static bool libsecam_client_create_shm(libsecam_client_t *self, int width, int height)
+{
+    size_t frames_offset = libsecam_client_round_page(sizeof(libsecam_server_shm_t));
+
+    self->frame_size = libsecam_client_round_page((size_t) width * height * 4);
+    self->shm_size = frames_offset + 2 * self->num_slots * self->frame_size;
+
+    self->memfd = memfd_create("libsecam", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (self->memfd < 0
+        || ftruncate(self->memfd, (off_t) self->shm_size) < 0
+        || fcntl(self->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        return false;
+    }
+
+    void *memory = mmap(NULL, self->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, self->memfd, 0);
+
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+
+    // New memory is zeroed, so counters and slot flags already are.
+    self->shm = (libsecam_server_shm_t *) memory;
+    self->shm->magic = LIBSECAM_SERVER_MAGIC;
+    self->shm->version = LIBSECAM_SERVER_VERSION;
+    self->shm->width = width;
+    self->shm->height = height;
+    self->shm->num_slots = self->num_slots;
+    self->shm->frames_offset = (uint32_t) frames_offset;
+    self->shm->frame_size = self->frame_size;
+
+    self->frames = (unsigned char *) memory + frames_offset;
+
+    return true;
+}
+
+/**
+ * Check that the server runs as the same user. Anyone can create the
+ * socket in /tmp first, and frames shouldn't go to them.
+ */
+static bool libsecam_client_check_peer(libsecam_client_t *self)
+{
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+
+    if (getsockopt(self->sock, SOL_SOCKET, SO_PEERCRED, &peer, &length) < 0) {
+        return false;
+    }
+
+    if (peer.uid != getuid()) {
+        errno = EPERM;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Pass memory and doorbells to the server, then wait for its answer.
+ */
+static bool libsecam_client_handshake(libsecam_client_t *self)
+{
+    int fds[3] = { self->memfd, self->submit_fd, self->done_fd };
+    uint32_t version = LIBSECAM_SERVER_VERSION;
+
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(fds))];
+    } control;
+
+    struct iovec iov = { &version, sizeof(version) };
+    struct msghdr message;
+
+    memset(&control, 0, sizeof(control));
+    memset(&message, 0, sizeof(message));
+
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(self->sock, &message, MSG_NOSIGNAL) != (ssize_t) sizeof(version)) {
+        return false;
+    }
+
+    int32_t status;
+    ssize_t size;
+
+    do {
+        size = recv(self->sock, &status, sizeof(status), 0);
+    } while (size < 0 && errno == EINTR);
+
+    if (size != (ssize_t) sizeof(status)) {
+        if (size >= 0) {
+            errno = ECONNRESET;
+        }
+
+        return false;
+    }
+
+    if (status != 0) {
+        errno = status;
+        return false;
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+/**
+ * Default socket of the server: libsecam.sock in XDG_RUNTIME_DIR,
+ * or /tmp/libsecam-UID.sock if it's not set.
+ */
+void libsecam_server_path(char *buffer, size_t size)
+{
+    char const *dir = getenv("XDG_RUNTIME_DIR");
+
+    if (dir && dir[0]) {
+        snprintf(buffer, size, "%s/libsecam.sock", dir);
+    } else {
+        snprintf(buffer, size, "/tmp/libsecam-%u.sock", (unsigned int) getuid());
+    }
+}
+
+/**
+ * Connect to the server at the path, NULL is the default one.
+ */
+libsecam_client_t *libsecam_client_connect(char const *path, int width, int height, int num_slots)
+{
+    if (width <= 0 || width > LIBSECAM_SERVER_MAX_SIZE
+        || height <= 0 || height > LIBSECAM_SERVER_MAX_SIZE
+        || num_slots <= 0 || num_slots > LIBSECAM_SERVER_MAX_SLOTS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct sockaddr_un address;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (path) {
+        if (strlen(path) >= sizeof(address.sun_path)) {
+            errno = ENAMETOOLONG;
+            return NULL;
+        }
+
+        strcpy(address.sun_path, path);
+    } else {
+        libsecam_server_path(address.sun_path, sizeof(address.sun_path));
+    }
+
+    libsecam_client_t *self = (libsecam_client_t *) calloc(1, sizeof(*self));
+
+    if (!self) {
+        return NULL;
+    }
+
+    self->sock = -1;
+    self->memfd = -1;
+    self->submit_fd = -1;
+    self->done_fd = -1;
+    self->num_slots = num_slots;
+
+    bool ok = (self->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) >= 0
+        && connect(self->sock, (struct sockaddr const *) &address, sizeof(address)) == 0
+        && libsecam_client_check_peer(self)
+        && libsecam_client_create_shm(self, width, height)
+        && (self->submit_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) >= 0
+        && (self->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) >= 0
+        && libsecam_client_handshake(self);
+
+    if (!ok) {
+        int error = errno;
+
+        libsecam_client_close(self);
+        errno = error;
+
+        return NULL;
+    }
+
+    return self;
+}
+
+/**
+ * Disconnect. Frames still being filtered are dropped.
+ */
+void libsecam_client_close(libsecam_client_t *self)
+{
+    if (!self) {
+        return;
+    }
+
+    if (self->shm) {
+        munmap(self->shm, self->shm_size);
+    }
+
+    int const fds[] = { self->sock, self->memfd, self->submit_fd, self->done_fd };
+
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+
+    free(self);
+}
+
+/**
+ * Source frame of the slot, should be filled before submitting.
+ */
+unsigned char *libsecam_client_src(libsecam_client_t *self, int slot)
+{
+    return self->frames + self->frame_size * (2 * slot);
+}
+
+/**
+ * Filtered frame of the slot, valid once the slot is returned.
+ */
+unsigned char const *libsecam_client_dst(libsecam_client_t *self, int slot)
+{
+    return self->frames + self->frame_size * (2 * slot + 1);
+}
+
+void libsecam_client_seed(libsecam_client_t *self, int slot, unsigned int seed)
+{
+    if (slot < 0 || slot >= self->num_slots || self->busy[slot]) {
+        return;
+    }
+
+    self->shm->slots[slot].seed = seed;
+    self->shm->slots[slot].flags |= LIBSECAM_SLOT_SEED;
+}
+
+/**
+ * Pass the slot to the server. Fails if it's already submitted.
+ */
+bool libsecam_client_submit(libsecam_client_t *self, int slot, libsecam_options_t const *options)
+{
+    if (slot < 0 || slot >= self->num_slots || self->busy[slot]) {
+        errno = EINVAL;
+        return false;
+    }
+
+    libsecam_server_shm_t *shm = self->shm;
+
+    if (options) {
+        shm->slots[slot].options = *options;
+        shm->slots[slot].flags |= LIBSECAM_SLOT_OPTIONS;
+    }
+
+    self->busy[slot] = true;
+    self->pending++;
+
+    shm->submit[self->submit_tail % self->num_slots] = (uint32_t) slot;
+    __atomic_store_n(&shm->submit_tail, ++self->submit_tail, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+
+    return write(self->submit_fd, &one, sizeof(one)) == (ssize_t) sizeof(one);
+}
+
+/**
+ * Wait for the next filtered slot. Returns -1 if nothing is submitted,
+ * or if the server is gone (errno is EPIPE then).
+ */
+int libsecam_client_wait(libsecam_client_t *self)
+{
+    libsecam_server_shm_t *shm = self->shm;
+
+    if (self->pending == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (true) {
+        uint32_t tail = __atomic_load_n(&shm->done_tail, __ATOMIC_ACQUIRE);
+
+        if (self->done_head != tail) {
+            uint32_t slot = shm->done[self->done_head++ % self->num_slots];
+
+            if (slot >= (uint32_t) self->num_slots || !self->busy[slot]) {
+                errno = EPROTO;
+                return -1;
+            }
+
+            self->busy[slot] = false;
+            self->pending--;
+            shm->slots[slot].flags = 0;
+
+            return (int) slot;
+        }
+
+        struct pollfd fds[2] = {
+            { self->done_fd, POLLIN, 0 },
+            { self->sock, POLLIN, 0 },
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+
+            if (read(self->done_fd, &count, sizeof(count)) < 0
+                && errno != EINTR && errno != EAGAIN) {
+                return -1;
+            }
+        } else if (fds[1].revents) {
+            // Server doesn't send anything after the handshake.
+            errno = EPIPE;
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,129 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2023 tuorqai
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//------------------------------------------------------------------------------
+// libsecam_client.h: client of libsecam-server (Linux only)
+//
+// Usage:
+//      libsecam_client_t *client = libsecam_client_connect(NULL, width, height, 2);
+//
+//      memcpy(libsecam_client_src(client, 0), pixels, width * height * 4);
+//      libsecam_client_submit(client, 0, NULL);
+//
+//      int slot = libsecam_client_wait(client);
+//      use(libsecam_client_dst(client, slot));
+//
+//      libsecam_client_close(client);
+//
+// The client allocates shared memory for a number of slots, each holding
+// a source and a destination XRGB frame with tightly packed rows, and hands
+// it to the server when connecting. Frames are filtered right there, nothing
+// is copied through the socket. While a slot is submitted, it belongs to the
+// server, and neither of its frames should be touched until
+// libsecam_client_wait() returns it. Several slots may be submitted at once,
+// they are returned in the same order.
+//
+// Options passed to libsecam_client_submit() apply to the slot's frame and
+// those after it, NULL keeps the previous ones. Options start at defaults.
+// libsecam_client_seed() reseeds the filter before the slot's next frame.
+//
+// Functions that fail set errno. A client may only be used by one thread
+// at a time.
+//------------------------------------------------------------------------------
+
+#ifndef TUORQAI_LIBSECAM_CLIENT_H
+#define TUORQAI_LIBSECAM_CLIENT_H
+
+//------------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libsecam.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//------------------------------------------------------------------------------
+// Shared memory layout, version 1
+
+#define LIBSECAM_SERVER_MAGIC       0x4d434553      // "SECM"
+#define LIBSECAM_SERVER_VERSION     1
+#define LIBSECAM_SERVER_MAX_SLOTS   64
+#define LIBSECAM_SERVER_MAX_SIZE    16384           // of width and height
+
+#define LIBSECAM_SLOT_SEED          0x01
+#define LIBSECAM_SLOT_OPTIONS       0x02
+
+typedef struct libsecam_server_slot
+{
+    uint32_t flags;                 // LIBSECAM_SLOT_*, cleared when done
+    uint32_t seed;
+    libsecam_options_t options;
+} libsecam_server_slot_t;
+
+/**
+ * Placed at the start of the memory, frames come after it. Both rings are
+ * indexed by their counters modulo the number of slots, and each counter
+ * is written by one side only, with release semantics.
+ */
+typedef struct libsecam_server_shm
+{
+    // Filled in by the client before connecting, read once by the server.
+    uint32_t magic;
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t num_slots;
+    uint32_t frames_offset;         // start of the first frame
+    uint64_t frame_size;            // distance between frames
+
+    // Slots to filter, written by the client.
+    __attribute__((aligned(64))) uint32_t submit_tail;
+    uint32_t submit[LIBSECAM_SERVER_MAX_SLOTS];
+
+    // Slots filtered, written by the server.
+    __attribute__((aligned(64))) uint32_t done_tail;
+    uint32_t done[LIBSECAM_SERVER_MAX_SLOTS];
+
+    __attribute__((aligned(64))) libsecam_server_slot_t slots[LIBSECAM_SERVER_MAX_SLOTS];
+} libsecam_server_shm_t;
+
+//------------------------------------------------------------------------------
+// Client
+
+typedef struct libsecam_client libsecam_client_t;
+
+void libsecam_server_path(char *buffer, size_t size);
+
+libsecam_client_t *libsecam_client_connect(char const *path, int width, int height, int num_slots);
+void libsecam_client_close(libsecam_client_t *self);
+unsigned char *libsecam_client_src(libsecam_client_t *self, int slot);
+unsigned char const *libsecam_client_dst(libsecam_client_t *self, int slot);
+void libsecam_client_seed(libsecam_client_t *self, int slot, unsigned int seed);
+bool libsecam_client_submit(libsecam_client_t *self, int slot, libsecam_options_t const *options);
+int libsecam_client_wait(libsecam_client_t *self);
+
+//------------------------------------------------------------------------------
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TUORQAI_LIBSECAM_CLIENT_H
@@ -0,0 +1,667 @@
+//------------------------------------------------------------------------------
+// cc -O2 -pthread -DLIBSECAM_USE_THREADS -I.. -o libsecam-server libsecam_server.c libsecam_client.c -lm
+//------------------------------------------------------------------------------
+// Usage:
+// ./libsecam-server
+//
+// Options:
+// -s PATH      socket to listen on, default is libsecam.sock in
+//              XDG_RUNTIME_DIR, or /tmp/libsecam-UID.sock
+// -t N         worker threads, 0 is one per CPU (default)
+// -T FILE      pick band count for every frame size, keep results in FILE
+//------------------------------------------------------------------------------
+// Filters frames of other processes in memory they share with it, using
+// one pool of worker threads for all of them, see libsecam_client.h.
+//
+// Each client is served by its own thread with its own libsecam instance,
+// all of them share one engine, so bands of frames from several clients
+// are processed at the same time. Frames of one client are filtered one
+// after another, in the order they were submitted.
+//
+// Clients are not trusted: the server keeps its own copies of the ring
+// counters, checks every slot index, copies slot options before using
+// them, only maps memory which can't be shrunk and only rings doorbells
+// which are eventfds, made non-blocking. A client breaking the protocol is
+// disconnected. Only the user running the server can connect: the socket
+// is private to it, and credentials of every peer are checked too, on both
+// sides, since anyone can create the socket in /tmp first.
+//------------------------------------------------------------------------------
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LIBSECAM_IMPLEMENTATION
+#include "../libsecam.h"
+#include "libsecam_client.h"
+
+//------------------------------------------------------------------------------
+
+struct client
+{
+    pthread_t thread;
+    int id;
+    int sock;
+    int memfd;
+    int submit_fd;
+    int done_fd;
+
+    libsecam_server_shm_t *shm;
+    size_t shm_size;
+    unsigned char *frames;
+    size_t frame_size;
+    int width;
+    int height;
+    int num_slots;
+
+    libsecam_t *libsecam;
+};
+
+static libsecam_engine_t *engine = NULL;
+static char const *wisdom_path = NULL;
+
+// Tuning one instance while another is being tuned would skew both.
+static pthread_mutex_t tune_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//------------------------------------------------------------------------------
+
+static double get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Receive memory and doorbells from a new client.
+ * Returns zero or error code.
+ */
+static int receive_hello(struct client *client)
+{
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+
+    // Socket permissions should stop other users, but don't rely on them.
+    if (getsockopt(client->sock, SOL_SOCKET, SO_PEERCRED, &peer, &length) < 0) {
+        return errno;
+    }
+
+    if (peer.uid != getuid()) {
+        return EPERM;
+    }
+
+    int fds[3];
+    uint32_t version = 0;
+
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(fds))];
+    } control;
+
+    struct iovec iov = { &version, sizeof(version) };
+    struct msghdr message;
+
+    memset(&control, 0, sizeof(control));
+    memset(&message, 0, sizeof(message));
+
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t size = recvmsg(client->sock, &message, MSG_CMSG_CLOEXEC);
+
+    if (size < 0) {
+        return errno;
+    }
+
+    // Closed without a word: another server checking if this one runs.
+    if (size == 0) {
+        return ECONNRESET;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return EPROTO;
+    }
+
+    // Whatever was received has to be closed, even if it's not enough.
+    int count = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (count < 3 ? count : 3));
+
+    if (count != 3 || size != (ssize_t) sizeof(version)) {
+        for (int i = 0; i < count && i < 3; i++) {
+            close(fds[i]);
+        }
+
+        return EPROTO;
+    }
+
+    client->memfd = fds[0];
+    client->submit_fd = fds[1];
+    client->done_fd = fds[2];
+
+    return (version == LIBSECAM_SERVER_VERSION) ? 0 : EPROTONOSUPPORT;
+}
+
+/**
+ * Check that descriptor is an eventfd and make it non-blocking, so that
+ * neither a pipe nor a counter filled by the client can block the server.
+ * Returns zero or error code.
+ */
+static int check_doorbell(int fd)
+{
+    char path[64];
+    char target[64];
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    ssize_t length = readlink(path, target, sizeof(target) - 1);
+
+    if (length < 0) {
+        return errno;
+    }
+
+    target[length] = '\0';
+
+    if (strcmp(target, "anon_inode:[eventfd]") != 0) {
+        return EBADF;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return errno;
+    }
+
+    return 0;
+}
+
+/**
+ * Check client's doorbells, map its memory and check its header.
+ * Returns zero or error code.
+ */
+static int attach_client(struct client *client)
+{
+    int status = check_doorbell(client->submit_fd);
+
+    if (status == 0) {
+        status = check_doorbell(client->done_fd);
+    }
+
+    if (status != 0) {
+        return status;
+    }
+
+    int seals = fcntl(client->memfd, F_GET_SEALS);
+
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        return EPERM;
+    }
+
+    struct stat st;
+
+    if (fstat(client->memfd, &st) < 0) {
+        return errno;
+    }
+
+    if (st.st_size < (off_t) sizeof(libsecam_server_shm_t)) {
+        return EINVAL;
+    }
+
+    void *memory = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, client->memfd, 0);
+
+    if (memory == MAP_FAILED) {
+        return errno;
+    }
+
+    client->shm = (libsecam_server_shm_t *) memory;
+    client->shm_size = (size_t) st.st_size;
+
+    // Read once, the client may change them any time.
+    libsecam_server_shm_t header = *client->shm;
+
+    if (header.magic != LIBSECAM_SERVER_MAGIC || header.version != LIBSECAM_SERVER_VERSION) {
+        return EPROTONOSUPPORT;
+    }
+
+    if (header.width <= 0 || header.width > LIBSECAM_SERVER_MAX_SIZE
+        || header.height <= 0 || header.height > LIBSECAM_SERVER_MAX_SIZE
+        || header.num_slots <= 0 || header.num_slots > LIBSECAM_SERVER_MAX_SLOTS
+        || header.frame_size < (uint64_t) header.width * header.height * 4
+        || header.frames_offset < sizeof(libsecam_server_shm_t)
+        || header.frames_offset > client->shm_size
+        || (client->shm_size - header.frames_offset) / 2 / header.num_slots < header.frame_size) {
+        return EINVAL;
+    }
+
+    client->width = header.width;
+    client->height = header.height;
+    client->num_slots = header.num_slots;
+    client->frame_size = (size_t) header.frame_size;
+    client->frames = (unsigned char *) memory + header.frames_offset;
+
+    client->libsecam = libsecam_init_shared(engine, client->width, client->height);
+
+    if (!client->libsecam) {
+        return ENOMEM;
+    }
+
+    if (wisdom_path) {
+        pthread_mutex_lock(&tune_mutex);
+        libsecam_autotune(client->libsecam, wisdom_path);
+        pthread_mutex_unlock(&tune_mutex);
+    }
+
+    return 0;
+}
+
+static void detach_client(struct client *client)
+{
+    if (client->libsecam) {
+        libsecam_close(client->libsecam);
+    }
+
+    if (client->shm) {
+        munmap(client->shm, client->shm_size);
+    }
+
+    int const fds[] = { client->sock, client->memfd, client->submit_fd, client->done_fd };
+
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+
+    free(client);
+}
+
+static double clamp_factor(double value)
+{
+    // Comparisons are false for NaN, which becomes zero.
+    return (value > 0.0) ? ((value < 1.0) ? value : 1.0) : 0.0;
+}
+
+static int clamp_offset(int value, int limit)
+{
+    return (value < -limit) ? -limit : ((value > limit) ? limit : value);
+}
+
+static bool read_flag(bool const *flag)
+{
+    unsigned char byte;
+
+    // Any byte could be there, not just a valid bool.
+    memcpy(&byte, flag, 1);
+
+    return byte != 0;
+}
+
+static bool filter_slot(struct client *client, uint32_t slot)
+{
+    libsecam_server_slot_t header = client->shm->slots[slot];
+
+    if (header.flags & LIBSECAM_SLOT_SEED) {
+        libsecam_seed(client->libsecam, header.seed);
+    }
+
+    if (header.flags & LIBSECAM_SLOT_OPTIONS) {
+        libsecam_options_t *options = libsecam_options(client->libsecam);
+
+        options->luma_noise = clamp_factor(header.options.luma_noise);
+        options->chroma_noise = clamp_factor(header.options.chroma_noise);
+        options->chroma_fire = clamp_factor(header.options.chroma_fire);
+        options->echo = clamp_offset(header.options.echo, client->width);
+        options->skew = clamp_offset(header.options.skew, client->width);
+        options->wobble = clamp_offset(header.options.wobble, client->width);
+        options->static_cache = read_flag(&header.options.static_cache);
+        options->noise_atlas = read_flag(&header.options.noise_atlas);
+    }
+
+    unsigned char *src = client->frames + client->frame_size * (2 * slot);
+
+    return libsecam_filter_to_buffer(client->libsecam, src, src + client->frame_size);
+}
+
+/**
+ * Filter submitted slots until the client disconnects or breaks the protocol.
+ */
+static void serve_client(struct client *client)
+{
+    libsecam_server_shm_t *shm = client->shm;
+    uint32_t num_slots = (uint32_t) client->num_slots;
+
+    // Own copies, shared ones can't be trusted.
+    uint32_t submit_head = 0;
+    uint32_t done_tail = 0;
+
+    int num_frames = 0;
+    double total_time = 0.0;
+    char const *error = NULL;
+
+    while (!error) {
+        struct pollfd fds[2] = {
+            { client->sock, POLLIN, 0 },
+            { client->submit_fd, POLLIN, 0 },
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            error = strerror(errno);
+            break;
+        }
+
+        // Client doesn't send anything after the handshake.
+        if (fds[0].revents) {
+            break;
+        }
+
+        if (!(fds[1].revents & POLLIN)) {
+            error = "bad doorbell";
+            break;
+        }
+
+        uint64_t count;
+
+        if (read(client->submit_fd, &count, sizeof(count)) != (ssize_t) sizeof(count)) {
+            // Emptied by the client itself, it has nothing to wait for.
+            if (errno == EAGAIN) {
+                continue;
+            }
+
+            error = "bad doorbell";
+            break;
+        }
+
+        uint32_t submit_tail = __atomic_load_n(&shm->submit_tail, __ATOMIC_ACQUIRE);
+
+        if (submit_tail - submit_head > num_slots) {
+            error = "submit ring overflow";
+            break;
+        }
+
+        while (submit_head != submit_tail) {
+            uint32_t slot = shm->submit[submit_head++ % num_slots];
+
+            if (slot >= num_slots) {
+                error = "bad slot index";
+                break;
+            }
+
+            double start = get_time();
+
+            if (!filter_slot(client, slot)) {
+                error = "out of memory";
+                break;
+            }
+
+            total_time += get_time() - start;
+            num_frames++;
+
+            shm->done[done_tail % num_slots] = slot;
+            __atomic_store_n(&shm->done_tail, ++done_tail, __ATOMIC_RELEASE);
+
+            // Fails with EAGAIN rather than blocking when the client filled
+            // the counter up.
+            uint64_t one = 1;
+
+            if (write(client->done_fd, &one, sizeof(one)) != (ssize_t) sizeof(one)) {
+                error = "bad doorbell";
+                break;
+            }
+        }
+    }
+
+    fprintf(stderr, "libsecam-server: client %d: %d frames, %.3f ms/frame%s%s\n",
+        client->id, num_frames, num_frames ? 1000.0 * total_time / num_frames : 0.0,
+        error ? ", disconnected: " : "", error ? error : "");
+}
+
+static void *client_main(void *arg)
+{
+    struct client *client = (struct client *) arg;
+    int32_t status = receive_hello(client);
+
+    if (status == 0) {
+        status = attach_client(client);
+    }
+
+    send(client->sock, &status, sizeof(status), MSG_NOSIGNAL);
+
+    if (status == 0) {
+        fprintf(stderr, "libsecam-server: client %d: %dx%d, %d slots\n",
+            client->id, client->width, client->height, client->num_slots);
+        serve_client(client);
+    } else if (status != ECONNRESET) {
+        fprintf(stderr, "libsecam-server: client %d rejected: %s\n",
+            client->id, strerror(status));
+    }
+
+    detach_client(client);
+
+    return NULL;
+}
+
+/**
+ * Listen on the path, replacing a socket left by a server that crashed.
+ */
+static int open_socket(char const *path)
+{
+    struct sockaddr_un address;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "libsecam-server: %s: path is too long\n", path);
+        return -1;
+    }
+
+    strcpy(address.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (sock < 0) {
+        perror("libsecam-server: socket");
+        return -1;
+    }
+
+    mode_t mask = umask(0077);
+    int result = bind(sock, (struct sockaddr const *) &address, sizeof(address));
+
+    if (result < 0 && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+        if (probe >= 0
+            && connect(probe, (struct sockaddr const *) &address, sizeof(address)) < 0
+            && errno == ECONNREFUSED) {
+            unlink(path);
+            result = bind(sock, (struct sockaddr const *) &address, sizeof(address));
+        } else {
+            errno = EADDRINUSE;
+        }
+
+        if (probe >= 0) {
+            int error = errno;
+
+            close(probe);
+            errno = error;
+        }
+    }
+
+    umask(mask);
+
+    if (result < 0 || listen(sock, 16) < 0) {
+        fprintf(stderr, "libsecam-server: %s: %s\n", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static int usage(char const *name)
+{
+    fprintf(stderr, "usage: %s [-s socket] [-t threads] [-T wisdom]\n", name);
+    return EXIT_FAILURE;
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    char default_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    char const *path = NULL;
+    int num_threads = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:t:T:")) != -1) {
+        switch (opt) {
+        case 's':
+            path = optarg;
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'T':
+            wisdom_path = optarg;
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+
+    if (optind != argc) {
+        return usage(argv[0]);
+    }
+
+    if (!path) {
+        libsecam_server_path(default_path, sizeof(default_path));
+        path = default_path;
+    }
+
+    // Blocked before any thread is started, so all of them inherit it,
+    // and the signals are only seen through signalfd.
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    if (signal_fd < 0) {
+        perror("libsecam-server: signalfd");
+        return EXIT_FAILURE;
+    }
+
+    engine = libsecam_engine_init(num_threads);
+
+    if (!engine) {
+        fprintf(stderr, "libsecam-server: failed to start worker threads\n");
+        return EXIT_FAILURE;
+    }
+
+    int sock = open_socket(path);
+
+    if (sock < 0) {
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "libsecam-server: listening on %s\n", path);
+
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int next_id = 1;
+
+    while (true) {
+        struct pollfd fds[2] = {
+            { sock, POLLIN, 0 },
+            { signal_fd, POLLIN, 0 },
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("libsecam-server: poll");
+            break;
+        }
+
+        if (fds[1].revents) {
+            break;
+        }
+
+        int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+                perror("libsecam-server: accept");
+            }
+
+            // Out of descriptors or memory, give clients a moment to leave.
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                poll(NULL, 0, 100);
+            }
+
+            continue;
+        }
+
+        struct client *client = (struct client *) calloc(1, sizeof(*client));
+
+        if (!client) {
+            close(fd);
+            continue;
+        }
+
+        client->id = next_id++;
+        client->sock = fd;
+        client->memfd = -1;
+        client->submit_fd = -1;
+        client->done_fd = -1;
+
+        if (pthread_create(&client->thread, &attr, client_main, client)) {
+            fprintf(stderr, "libsecam-server: failed to start client thread\n");
+            detach_client(client);
+        }
+    }
+
+    // Clients still connected go away with the process, the engine
+    // is not closed under their threads.
+    pthread_attr_destroy(&attr);
+    close(sock);
+    unlink(path);
+
+    fprintf(stderr, "libsecam-server: stopped\n");
+
+    return EXIT_SUCCESS;
+}
@@ -5,6 +5,17 @@
 // Usage:
 // ./ueit
 // ./ueit image.bmp
+// ./ueit --bench 500 --threads 4 --preset heavy image.bmp
+//------------------------------------------------------------------------------
+// Options:
+// --bench N: filter the image N times without opening a window,
+//            then print filter time statistics
+// --threads T: number of worker threads, 0 is one per CPU
+// --preset P: initial options, one of: default, clean, heavy
+// --trace FILE: with --bench, write Chrome trace of the timed frames
+//               (needs libsecam built with LIBSECAM_TRACE)
+// --perf: with --bench, also count cycles, instructions, cache and branch
+//         misses of every stage, for 1, 2, 4... bands (Linux only)
 //------------------------------------------------------------------------------
 // Controls:
 // Up/Down Arrow: select option
@@ -13,11 +24,56 @@
 // Enter: Filter for one frame (if paused)
 // Escape: exit
 //------------------------------------------------------------------------------
+// Filtering runs on its own thread and writes straight into one of three
+// streaming textures, which the render thread keeps locked for it.
+// Finished frame is passed to the render thread by swapping texture
+// indices atomically, so filter time overlaps rendering and vsync.
+//------------------------------------------------------------------------------
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SDL.h>
 #include <SDL_image.h>
 
+// Hardware counters are read around every stage of the filter through the
+// same hooks that LIBSECAM_TRACE uses, so it's one or the other.
+#if defined(__linux__) && !defined(LIBSECAM_TRACE)
+#define UEIT_PERF
+#endif
+
+#ifdef UEIT_PERF
+#include <errno.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+enum counter
+{
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_L1_MISSES,
+    COUNTER_LLC_MISSES,
+    COUNTER_BRANCH_MISSES,
+    TOTAL_COUNTERS,
+};
+
+struct counterSample
+{
+    unsigned long long values[TOTAL_COUNTERS];
+};
+
+static void readCounters(struct counterSample *sample);
+static void addStage(char const *name, struct counterSample const *start);
+
+#define LIBSECAM_TRACE_BEGIN(t) \
+    struct counterSample t; \
+    readCounters(&t)
+
+#define LIBSECAM_TRACE_END(t, name, frame, arg_name, arg) \
+    addStage(name, &t)
+#endif
+
 #define LIBSECAM_IMPLEMENTATION
 #include "../libsecam.h"
 
@@ -43,17 +99,73 @@ static char const *optionNames[TOTAL_OPTIONS] = {
     "WOBBLE",
 };
 
-static int pause = 0;
+struct preset
+{
+    char const *name;
+    libsecam_options_t options;
+};
+
+static struct preset const presets[] = {
+    {
+        "default",
+        {
+            LIBSECAM_DEFAULT_LUMA_NOISE,
+            LIBSECAM_DEFAULT_CHROMA_NOISE,
+            LIBSECAM_DEFAULT_CHROMA_FIRE,
+            LIBSECAM_DEFAULT_ECHO,
+            LIBSECAM_DEFAULT_SKEW,
+            LIBSECAM_DEFAULT_WOBBLE,
+            false,
+            false,
+        },
+    },
+    { "clean", { 0.0, 0.0, 0.0, 0, 0, 0, false, false } },
+    { "heavy", { 0.2, 0.6, 0.3, 8, 6, 2, false, false } },
+};
+
+struct arguments
+{
+    char const *path;
+    int benchIterations;
+    int threads;                    // -1 if not given
+    struct preset const *preset;
+    char const *tracePath;          // NULL if not given
+    int perf;
+};
+
+struct frame
+{
+    SDL_Texture *texture;
+    unsigned char *pixels;          // valid while the texture is locked
+    int pitch;
+    int locked;
+};
+
+#define TOTAL_FRAMES 3
+#define FRAME_READY 0x100           // flag of middleFrame: not shown yet
+
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
 static SDL_Surface *ueitSurface = NULL;
-static SDL_Texture *ueitTexture = NULL;
+static libsecam_engine_t *engine = NULL;
 static libsecam_t *libsecam = NULL;
 static libsecam_options_t *options = NULL;
 static enum option currentOption = 0;
-static int pingUpdate = 0;
 static char optionText[256];
 
+static struct frame frames[TOTAL_FRAMES];
+static int frontFrame = 0;          // shown, owned by render thread
+static int backFrame = 2;           // being filtered, owned by filter thread
+static SDL_atomic_t middleFrame;    // passed between the threads
+
+static SDL_Thread *filterThread = NULL;
+static SDL_mutex *optionsMutex = NULL;
+static libsecam_options_t uiOptions;
+static SDL_atomic_t paused;
+static SDL_atomic_t pingUpdate;
+static SDL_atomic_t quitFilter;
+static SDL_atomic_t filteredCounter;
+
 static void updateWindowTitle(void);
 
 //------------------------------------------------------------------------------
@@ -72,22 +184,118 @@ static SDL_Surface *loadImage(char const *path)
     return conv;
 }
 
-static void fillTexture(SDL_Texture *texture, unsigned char const *pixels, int width, int height)
+static int lockFrame(struct frame *frame)
 {
-    unsigned char *data;
-    int pitch;
+    void *pixels;
+
+    if (SDL_LockTexture(frame->texture, NULL, &pixels, &frame->pitch)) {
+        return 1;
+    }
+
+    frame->pixels = pixels;
+    frame->locked = 1;
+
+    return 0;
+}
+
+static void unlockFrame(struct frame *frame)
+{
+    SDL_UnlockTexture(frame->texture);
+    frame->locked = 0;
+}
+
+/**
+ * Filter thread: fill the back frame, then swap it with the middle one.
+ */
+static int filterMain(void *data)
+{
+    (void) data;
+
+    while (!SDL_AtomicGet(&quitFilter)) {
+        int ping = SDL_AtomicSet(&pingUpdate, 0);
+
+        if (SDL_AtomicGet(&paused) && !ping) {
+            SDL_Delay(10);
+            continue;
+        }
+
+        SDL_LockMutex(optionsMutex);
+        *libsecam_options(libsecam) = uiOptions;
+        SDL_UnlockMutex(optionsMutex);
 
-    SDL_LockTexture(texture, NULL, (void **) &data, &pitch);
+        struct frame *back = &frames[backFrame];
 
-    for (int i = 0; i < height; i++) {
-        unsigned char const *row = &pixels[i * width * 4];
-        memcpy(&data[i * pitch], row, width * 4);
+        libsecam_filter_region(libsecam, ueitSurface->pixels, ueitSurface->pitch,
+            back->pixels, back->pitch, 0, 0);
+
+        SDL_AtomicAdd(&filteredCounter, 1);
+
+        // Don't run more than one frame ahead of the screen.
+        while ((SDL_AtomicGet(&middleFrame) & FRAME_READY) && !SDL_AtomicGet(&quitFilter)) {
+            SDL_Delay(1);
+        }
+
+        // Whatever comes back is locked and free to be written to.
+        backFrame = SDL_AtomicSet(&middleFrame, backFrame | FRAME_READY) & ~FRAME_READY;
     }
 
-    SDL_UnlockTexture(texture);
+    return 0;
 }
 
-static int initialize(char const *path)
+/**
+ * Show the newest filtered frame, if there is one.
+ * Texture that was shown so far is locked and given to the filter thread.
+ */
+static void swapFrames(void)
+{
+    if (!(SDL_AtomicGet(&middleFrame) & FRAME_READY)) {
+        return;
+    }
+
+    if (lockFrame(&frames[frontFrame])) {
+        return;
+    }
+
+    int ready = SDL_AtomicSet(&middleFrame, frontFrame) & ~FRAME_READY;
+
+    unlockFrame(&frames[ready]);
+    frontFrame = ready;
+}
+
+static int createFilter(struct arguments const *args, int width, int height)
+{
+    if (args->threads >= 0) {
+        if ((engine = libsecam_engine_init(args->threads)) == NULL) {
+            return 1;
+        }
+
+        libsecam = libsecam_init_shared(engine, width, height);
+    } else {
+        libsecam = libsecam_init(width, height);
+    }
+
+    if (libsecam == NULL) {
+        return 1;
+    }
+
+    options = libsecam_options(libsecam);
+    *options = args->preset->options;
+
+    return 0;
+}
+
+static void destroyFilter(void)
+{
+    if (libsecam) {
+        libsecam_close(libsecam);
+    }
+
+    if (engine) {
+        libsecam_engine_close(engine);
+    }
+}
+
+static int initialize(struct arguments const *args)
 {
     if (SDL_Init(SDL_INIT_VIDEO)) {
         return 1;
@@ -109,25 +317,61 @@ static int initialize(char const *path)
     SDL_RenderSetVSync(renderer, 1);
     SDL_RenderSetLogicalSize(renderer, 720, 576);
 
-    if ((ueitSurface = loadImage(path ? path : "ueit.bmp")) == NULL) {
+    if ((ueitSurface = loadImage(args->path)) == NULL) {
+        return 1;
+    }
+
+    for (int i = 0; i < TOTAL_FRAMES; i++) {
+        if ((frames[i].texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
+            SDL_TEXTUREACCESS_STREAMING, ueitSurface->w, ueitSurface->h)) == NULL) {
+            return 1;
+        }
+    }
+
+    // Front frame is shown, the others are for the filter thread to fill.
+    if (lockFrame(&frames[1]) || lockFrame(&frames[2])) {
         return 1;
     }
 
-    if ((ueitTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
-        SDL_TEXTUREACCESS_STREAMING, ueitSurface->w, ueitSurface->h)) == NULL) {
+    frontFrame = 0;
+    backFrame = 2;
+    SDL_AtomicSet(&middleFrame, 1);
+
+    if (createFilter(args, ueitSurface->w, ueitSurface->h)) {
         return 1;
     }
 
-    libsecam = libsecam_init(ueitSurface->w, ueitSurface->h);
-    options = libsecam_options(libsecam);
+    // Filter thread gets a copy of the options every frame.
+    uiOptions = *options;
+    options = &uiOptions;
+
+    if ((optionsMutex = SDL_CreateMutex()) == NULL) {
+        return 1;
+    }
+
+    if ((filterThread = SDL_CreateThread(filterMain, "filter", NULL)) == NULL) {
+        return 1;
+    }
 
     return 0;
 }
 
 static void terminate(void)
 {
-    libsecam_close(libsecam);
-    SDL_DestroyTexture(ueitTexture);
+    SDL_AtomicSet(&quitFilter, 1);
+    SDL_WaitThread(filterThread, NULL);
+    SDL_DestroyMutex(optionsMutex);
+
+    destroyFilter();
+
+    for (int i = 0; i < TOTAL_FRAMES; i++) {
+        if (frames[i].locked) {
+            unlockFrame(&frames[i]);
+        }
+
+        SDL_DestroyTexture(frames[i].texture);
+    }
+
     SDL_FreeSurface(ueitSurface);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
@@ -218,10 +462,10 @@ static void keyInput(SDL_Scancode key, unsigned int mod)
 {
     switch (key) {
     case SDL_SCANCODE_SPACE:
-        pause = !pause;
+        SDL_AtomicSet(&paused, !SDL_AtomicGet(&paused));
         break;
     case SDL_SCANCODE_RETURN:
-        pingUpdate = 1;
+        SDL_AtomicSet(&pingUpdate, 1);
         break;
     case SDL_SCANCODE_UP:
         if (currentOption > 0) {
@@ -238,12 +482,12 @@ static void keyInput(SDL_Scancode key, unsigned int mod)
     case SDL_SCANCODE_LEFT:
         decrementOption((mod & KMOD_SHIFT) ? 10.0 : ((mod & KMOD_CTRL) ? 0.1 : 1.0));
         printOption();
-        pingUpdate = 1;
+        SDL_AtomicSet(&pingUpdate, 1);
         break;
     case SDL_SCANCODE_RIGHT:
         incrementOption((mod & KMOD_SHIFT) ? 10.0 : ((mod & KMOD_CTRL) ? 0.1 : 1.0));
         printOption();
-        pingUpdate = 1;
+        SDL_AtomicSet(&pingUpdate, 1);
         break;
     case SDL_SCANCODE_BACKSPACE:
         options->luma_noise = LIBSECAM_DEFAULT_LUMA_NOISE;
@@ -280,7 +524,9 @@ static int process(void)
             if (event.key.keysym.scancode == SDL_SCANCODE_ESCAPE) {
                 return 1;
             } else {
+                SDL_LockMutex(optionsMutex);
                 keyInput(event.key.keysym.scancode, event.key.keysym.mod);
+                SDL_UnlockMutex(optionsMutex);
             }
             break;
         default:
@@ -295,13 +541,14 @@ static int framerateCounter = 0;
 static unsigned int framerateLastCheck = 0;
 static int framerateValue = -1;
 static float framerateAvg = -1.f;
+static int filterRateValue = -1;
 static char windowTitleBuffer[256];
 
 static void updateWindowTitle(void)
 {
     snprintf(windowTitleBuffer, sizeof(windowTitleBuffer) - 1,
-        "UEIT [%d fps, %.2f ms avg] (%s)",
-        framerateValue, framerateAvg, optionText);
+        "UEIT [%d fps, %d filtered, %.2f ms avg] (%s)",
+        framerateValue, filterRateValue, framerateAvg, optionText);
 
     SDL_SetWindowTitle(window, windowTitleBuffer);
 }
@@ -313,36 +560,660 @@ static void loop(void)
     if ((ticks - framerateLastCheck) > 1000) {
         framerateValue = framerateCounter;
         framerateAvg = (ticks - framerateLastCheck) / (float) framerateCounter;
+        filterRateValue = SDL_AtomicSet(&filteredCounter, 0);
         updateWindowTitle();
         framerateLastCheck = ticks;
         framerateCounter = 0;
     }
 
-    if (pause == 0 || pingUpdate) {
-        SDL_UnlockSurface(ueitSurface);
-        unsigned char const *filtered = libsecam_filter(libsecam, ueitSurface->pixels);
-        SDL_LockSurface(ueitSurface);
-
-        fillTexture(ueitTexture, filtered, ueitSurface->w, ueitSurface->h);
-
-        if (pingUpdate) {
-            pingUpdate = 0;
-        }
-    }
+    swapFrames();
 
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, ueitTexture, NULL, NULL);
+    SDL_RenderCopy(renderer, frames[frontFrame].texture, NULL, NULL);
     SDL_RenderPresent(renderer);
 
     framerateCounter++;
 }
 
 //------------------------------------------------------------------------------
+// Hardware counters (--perf)
+
+#ifdef UEIT_PERF
+
+#define MAX_STAGES 16
+
+struct stageCounters
+{
+    char const *name;               // static string from libsecam
+    long long calls;
+    unsigned long long values[TOTAL_COUNTERS];
+};
+
+/**
+ * Counters of one thread, opened when it enters a stage for the first time.
+ * All events are in one group, so they are scheduled together and read
+ * with one syscall.
+ */
+struct threadCounters
+{
+    int fds[TOTAL_COUNTERS];        // -1 if not supported
+    int slots[TOTAL_COUNTERS];      // index in the group read
+    int size;                       // 0 if even cycles can't be counted
+    struct stageCounters stages[MAX_STAGES];
+    struct threadCounters *next;
+};
+
+static struct
+{
+    char const *name;
+    unsigned int type;
+    unsigned long long config;
+} const counterEvents[TOTAL_COUNTERS] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    {
+        "L1d misses",
+        PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    },
+    { "LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+// Stages in the order they are printed.
+static char const *const stageNames[] = {
+    "frame", "pre-pass", "band", "unpack", "convert", "luma", "chroma", "revert", "pack",
+};
+
+static SDL_atomic_t perfActive;     // stages are counted only while set
+static SDL_SpinLock perfLock;       // guards perfThreads and perfError
+static struct threadCounters *perfThreads = NULL;
+static int perfError = 0;           // errno of the first failed group
+static __thread struct threadCounters *perfSelf = NULL;
+
+static int openCounter(int index, int groupFd)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counterEvents[index].type;
+    attr.config = counterEvents[index].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // Calling thread, whatever CPU it runs on.
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+static struct threadCounters *openThreadCounters(void)
+{
+    struct threadCounters *thread = calloc(1, sizeof(*thread));
+
+    if (!thread) {
+        return NULL;
+    }
+
+    int error = 0;
+
+    for (int i = 0; i < TOTAL_COUNTERS; i++) {
+        thread->fds[i] = -1;
+        thread->slots[i] = -1;
+
+        // Cycles lead the group, nothing else is useful without them.
+        if (i > 0 && thread->fds[0] < 0) {
+            continue;
+        }
+
+        int fd = openCounter(i, thread->fds[0]);
+
+        if (fd < 0) {
+            if (i == 0) {
+                error = errno;
+            }
+
+            continue;
+        }
+
+        thread->fds[i] = fd;
+        thread->slots[i] = thread->size++;
+    }
+
+    SDL_AtomicLock(&perfLock);
+    thread->next = perfThreads;
+    perfThreads = thread;
+
+    if (error && !perfError) {
+        perfError = error;
+    }
+
+    SDL_AtomicUnlock(&perfLock);
+
+    return thread;
+}
+
+static void readCounters(struct counterSample *sample)
+{
+    memset(sample, 0, sizeof(*sample));
+
+    if (!SDL_AtomicGet(&perfActive)) {
+        return;
+    }
+
+    if (!perfSelf) {
+        perfSelf = openThreadCounters();
+    }
+
+    struct threadCounters *thread = perfSelf;
+
+    if (!thread || thread->size == 0) {
+        return;
+    }
+
+    // Number of events, then their values.
+    unsigned long long buffer[1 + TOTAL_COUNTERS];
+    ssize_t size = (ssize_t) (sizeof(buffer[0]) * (1 + thread->size));
+
+    if (read(thread->fds[0], buffer, sizeof(buffer)) != size) {
+        return;
+    }
+
+    for (int i = 0; i < TOTAL_COUNTERS; i++) {
+        if (thread->slots[i] >= 0) {
+            sample->values[i] = buffer[1 + thread->slots[i]];
+        }
+    }
+}
+
+static void addStage(char const *name, struct counterSample const *start)
+{
+    struct counterSample end;
+
+    if (!SDL_AtomicGet(&perfActive)) {
+        return;
+    }
+
+    readCounters(&end);
+
+    struct threadCounters *thread = perfSelf;
+
+    if (!thread || thread->size == 0) {
+        return;
+    }
+
+    // Names are static, so pointers are enough here.
+    int i = 0;
+
+    while (i < MAX_STAGES && thread->stages[i].name && thread->stages[i].name != name) {
+        i++;
+    }
+
+    if (i == MAX_STAGES) {
+        return;
+    }
+
+    struct stageCounters *stage = &thread->stages[i];
+
+    stage->name = name;
+    stage->calls++;
+
+    for (int j = 0; j < TOTAL_COUNTERS; j++) {
+        stage->values[j] += end.values[j] - start->values[j];
+    }
+}
+
+static void resetCounters(void)
+{
+    for (struct threadCounters *thread = perfThreads; thread; thread = thread->next) {
+        memset(thread->stages, 0, sizeof(thread->stages));
+    }
+}
+
+/**
+ * Should be called when no other thread can enter a stage.
+ */
+static void closeCounters(void)
+{
+    while (perfThreads) {
+        struct threadCounters *thread = perfThreads;
+
+        for (int i = TOTAL_COUNTERS - 1; i >= 0; i--) {
+            if (thread->fds[i] >= 0) {
+                close(thread->fds[i]);
+            }
+        }
+
+        perfThreads = thread->next;
+        free(thread);
+    }
+
+    perfSelf = NULL;
+}
+
+/**
+ * Sum of the stage over all threads.
+ */
+static struct stageCounters sumStage(char const *name)
+{
+    struct stageCounters sum;
+
+    memset(&sum, 0, sizeof(sum));
+    sum.name = name;
+
+    for (struct threadCounters *thread = perfThreads; thread; thread = thread->next) {
+        for (int i = 0; i < MAX_STAGES && thread->stages[i].name; i++) {
+            struct stageCounters const *stage = &thread->stages[i];
+
+            if (strcmp(stage->name, name) != 0) {
+                continue;
+            }
+
+            sum.calls += stage->calls;
+
+            for (int j = 0; j < TOTAL_COUNTERS; j++) {
+                sum.values[j] += stage->values[j];
+            }
+        }
+    }
+
+    return sum;
+}
+
+/**
+ * Print events of the counter per thousand instructions, or a dash
+ * if either isn't counted.
+ */
+static void printMisses(struct stageCounters const *stage, int counter, int const *counted)
+{
+    if (!counted[counter] || !counted[COUNTER_INSTRUCTIONS] || !stage->values[COUNTER_INSTRUCTIONS]) {
+        printf(" %9s", "-");
+        return;
+    }
+
+    printf(" %9.2f", 1000.0 * stage->values[counter] / stage->values[COUNTER_INSTRUCTIONS]);
+}
+
+/**
+ * Frame is counted on the calling thread only, which mostly waits for bands.
+ */
+static void printStages(int frames, int const *counted)
+{
+    printf("    %-10s %9s %10s %6s %9s %9s %9s\n",
+        "stage", "calls", "Mcyc/frm", "IPC", "L1d MPKI", "LLC MPKI", "br MPKI");
+
+    for (size_t i = 0; i < sizeof(stageNames) / sizeof(stageNames[0]); i++) {
+        struct stageCounters stage = sumStage(stageNames[i]);
+
+        if (stage.calls == 0) {
+            continue;
+        }
+
+        unsigned long long cycles = stage.values[COUNTER_CYCLES];
+
+        printf("    %-10s %9lld %10.3f", stage.name, stage.calls, cycles / 1e6 / frames);
+
+        if (counted[COUNTER_INSTRUCTIONS] && cycles > 0) {
+            printf(" %6.2f", (double) stage.values[COUNTER_INSTRUCTIONS] / cycles);
+        } else {
+            printf(" %6s", "-");
+        }
+
+        printMisses(&stage, COUNTER_L1_MISSES, counted);
+        printMisses(&stage, COUNTER_LLC_MISSES, counted);
+        printMisses(&stage, COUNTER_BRANCH_MISSES, counted);
+        printf("\n");
+    }
+}
+
+/**
+ * Copy rate of memory of the frame size, in bytes per second and,
+ * if cycles are counted, per cycle.
+ */
+static void measureCopy(size_t size, int count, double *perSecond, double *perCycle)
+{
+    unsigned char *a = malloc(size);
+    unsigned char *b = malloc(size);
+
+    *perSecond = 0.0;
+    *perCycle = 0.0;
+
+    if (!a || !b) {
+        free(a);
+        free(b);
+        return;
+    }
+
+    // Touch the pages first, so page faults aren't measured.
+    memset(a, 1, size);
+    memset(b, 2, size);
+
+    struct counterSample start, end;
+    double frequency = (double) SDL_GetPerformanceFrequency();
+
+    Uint64 startTime = SDL_GetPerformanceCounter();
+    readCounters(&start);
+
+    // Back and forth, so repeated copies can't be folded into one.
+    for (int i = 0; i < count; i++) {
+        if (i % 2) {
+            memcpy(a, b, size);
+        } else {
+            memcpy(b, a, size);
+        }
+    }
+
+    readCounters(&end);
+    Uint64 endTime = SDL_GetPerformanceCounter();
+
+    double bytes = (double) size * count;
+    unsigned long long cycles = end.values[COUNTER_CYCLES] - start.values[COUNTER_CYCLES];
+
+    if (endTime > startTime) {
+        *perSecond = bytes * frequency / (endTime - startTime);
+    }
+
+    if (cycles > 0) {
+        *perCycle = bytes / cycles;
+    }
+
+    free(a);
+    free(b);
+}
+
+static int readParanoid(void)
+{
+    FILE *file = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+    int value = -100;
+
+    if (file) {
+        if (fscanf(file, "%d", &value) != 1) {
+            value = -100;
+        }
+
+        fclose(file);
+    }
+
+    return value;
+}
+
+/**
+ * Filter the image with 1, 2, 4... bands, up to the number of worker
+ * threads, timing it, then counting events of every stage on every thread
+ * in another pass. Counts of a stage include reading counters of stages
+ * within it, e.g. band of its lines.
+ * Without counters (e.g. in a container) only the timing is printed.
+ */
+static void perfBenchmark(struct arguments const *args, int count)
+{
+    int maxBands = (args->threads > 0) ? args->threads
+        : (args->threads == 0) ? SDL_GetCPUCount()
+        : LIBSECAM_NUM_THREADS;
+
+    // Both are counted as bytes copied from one place to another.
+    size_t frameSize = (size_t) ueitSurface->pitch * ueitSurface->h;
+    double copyRate, copyPerCycle;
+
+    fflush(stdout);
+
+    SDL_AtomicSet(&perfActive, 1);
+    measureCopy(frameSize, count, &copyRate, &copyPerCycle);
+    SDL_AtomicSet(&perfActive, 0);
+
+    int counted[TOTAL_COUNTERS] = { 0 };
+
+    if (perfSelf) {
+        for (int i = 0; i < TOTAL_COUNTERS; i++) {
+            counted[i] = (perfSelf->fds[i] >= 0);
+
+            if (perfSelf->size > 0 && !counted[i]) {
+                fprintf(stderr, "ueit: %s are not counted on this CPU\n", counterEvents[i].name);
+            }
+        }
+    }
+
+    if (!counted[COUNTER_CYCLES]) {
+        int paranoid = readParanoid();
+
+        fprintf(stderr, "ueit: hardware counters unavailable: %s", strerror(perfError ? perfError : ENOMEM));
+
+        if (paranoid != -100) {
+            fprintf(stderr, " (perf_event_paranoid is %d)", paranoid);
+        }
+
+        fprintf(stderr, ", timing only\n");
+    }
+
+    printf("memcpy: %.2f GB/s", copyRate / 1e9);
+
+    if (counted[COUNTER_CYCLES]) {
+        printf(", %.2f bytes/cycle", copyPerCycle);
+    }
+
+    printf("\n");
+
+    double frequency = (double) SDL_GetPerformanceFrequency();
+
+    for (int bands = 1; ; bands *= 2) {
+        if (bands > maxBands) {
+            bands = maxBands;
+        }
+
+        libsecam_set_threads(libsecam, bands);
+        libsecam_filter(libsecam, ueitSurface->pixels);
+
+        // Counters are read around every line stage, which would be timed
+        // too, so timing and counting are separate passes.
+        Uint64 start = SDL_GetPerformanceCounter();
+
+        for (int i = 0; i < count; i++) {
+            libsecam_filter(libsecam, ueitSurface->pixels);
+        }
+
+        Uint64 end = SDL_GetPerformanceCounter();
+
+        if (counted[COUNTER_CYCLES]) {
+            resetCounters();
+            SDL_AtomicSet(&perfActive, 1);
+
+            for (int i = 0; i < count; i++) {
+                libsecam_filter(libsecam, ueitSurface->pixels);
+            }
+
+            SDL_AtomicSet(&perfActive, 0);
+        }
+
+        double seconds = (end - start) / frequency;
+        double rate = (double) frameSize * count / seconds;
+
+        printf("%d bands: %.3f ms/frame, %.2f GB/s (%.1f%% of memcpy)",
+            bands, 1000.0 * seconds / count, rate / 1e9,
+            copyRate > 0.0 ? 100.0 * rate / copyRate : 0.0);
+
+        if (counted[COUNTER_CYCLES]) {
+            // Cycles spent working on the frame, on all threads, without waiting.
+            unsigned long long cycles = sumStage("pre-pass").values[COUNTER_CYCLES]
+                + sumStage("band").values[COUNTER_CYCLES];
+
+            if (cycles > 0) {
+                double perCycle = (double) frameSize * count / cycles;
+
+                printf(", %.2f bytes/cycle (%.1f%% of memcpy)",
+                    perCycle, copyPerCycle > 0.0 ? 100.0 * perCycle / copyPerCycle : 0.0);
+            } else {
+                printf(", counters didn't run (PMU busy?)");
+            }
+        }
+
+        printf("\n");
+
+        if (counted[COUNTER_CYCLES]) {
+            printStages(count, counted);
+        }
+
+        if (bands == maxBands) {
+            break;
+        }
+    }
+}
+
+#endif // UEIT_PERF
+
+//------------------------------------------------------------------------------
+
+static int compareTimes(void const *a, void const *b)
+{
+    double x = *(double const *) a;
+    double y = *(double const *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Filter the image over and over without a window.
+ * Only libsecam_filter() is timed, so it's fine to run under perf.
+ */
+static int benchmark(struct arguments const *args)
+{
+    if (SDL_Init(0) || IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG) == 0) {
+        fprintf(stderr, "ueit: %s\n", SDL_GetError());
+        return EXIT_FAILURE;
+    }
+
+    if ((ueitSurface = loadImage(args->path)) == NULL) {
+        fprintf(stderr, "ueit: %s\n", SDL_GetError());
+        return EXIT_FAILURE;
+    }
+
+    int count = args->benchIterations;
+    double *times = malloc(sizeof(*times) * count);
+
+    if (times == NULL || createFilter(args, ueitSurface->w, ueitSurface->h)) {
+        fprintf(stderr, "ueit: failed to initialize libsecam\n");
+        return EXIT_FAILURE;
+    }
+
+    // First frame allocates buffers and starts the threads.
+    libsecam_filter(libsecam, ueitSurface->pixels);
+
+#ifdef LIBSECAM_TRACE
+    libsecam_trace_clear();
+#endif
+
+    double frequency = (double) SDL_GetPerformanceFrequency();
+    double total = 0.0;
+
+    for (int i = 0; i < count; i++) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        libsecam_filter(libsecam, ueitSurface->pixels);
+        Uint64 end = SDL_GetPerformanceCounter();
+
+        times[i] = (end - start) * 1000.0 / frequency;
+        total += times[i];
+    }
+
+    qsort(times, count, sizeof(*times), compareTimes);
+
+    int p99 = (count * 99 + 99) / 100 - 1;
+
+    printf("%dx%d, %d frames, preset %s: min %.3f ms, avg %.3f ms, p99 %.3f ms, max %.3f ms\n",
+        ueitSurface->w, ueitSurface->h, count, args->preset->name,
+        times[0], total / count, times[p99], times[count - 1]);
+
+    if (args->tracePath) {
+#ifdef LIBSECAM_TRACE
+        if (!libsecam_trace_dump(args->tracePath)) {
+            fprintf(stderr, "ueit: failed to write %s\n", args->tracePath);
+        }
+#else
+        fprintf(stderr, "ueit: built without LIBSECAM_TRACE, no trace written\n");
+#endif
+    }
+
+    if (args->perf) {
+#ifdef UEIT_PERF
+        perfBenchmark(args, count);
+#else
+        fprintf(stderr, "ueit: --perf needs Linux and a build without LIBSECAM_TRACE\n");
+#endif
+    }
+
+    free(times);
+    destroyFilter();
+
+#ifdef UEIT_PERF
+    closeCounters();
+#endif
+    SDL_FreeSurface(ueitSurface);
+    IMG_Quit();
+    SDL_Quit();
+
+    return EXIT_SUCCESS;
+}
+
+static int parseArguments(struct arguments *args, int argc, char *argv[])
+{
+    args->path = "ueit.bmp";
+    args->benchIterations = 0;
+    args->threads = -1;
+    args->preset = &presets[0];
+    args->tracePath = NULL;
+    args->perf = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0 && (i + 1) < argc) {
+            args->benchIterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && (i + 1) < argc) {
+            args->threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && (i + 1) < argc) {
+            args->tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            args->perf = 1;
+        } else if (strcmp(argv[i], "--preset") == 0 && (i + 1) < argc) {
+            char const *name = argv[++i];
+            int count = sizeof(presets) / sizeof(presets[0]);
+            int j;
+
+            for (j = 0; j < count; j++) {
+                if (strcmp(presets[j].name, name) == 0) {
+                    break;
+                }
+            }
+
+            if (j == count) {
+                fprintf(stderr, "ueit: unknown preset: %s\n", name);
+                return 1;
+            }
+
+            args->preset = &presets[j];
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "usage: %s [--bench N] [--threads T] "
+                "[--preset default|clean|heavy] [--trace FILE] [--perf] [image]\n", argv[0]);
+            return 1;
+        } else {
+            args->path = argv[i];
+        }
+    }
+
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
-    if (initialize((argc < 2) ? NULL : argv[1])) {
+    struct arguments args;
+
+    if (parseArguments(&args, argc, argv)) {
+        return EXIT_FAILURE;
+    }
+
+    if (args.benchIterations > 0) {
+        return benchmark(&args);
+    }
+
+    if (initialize(&args)) {
         return EXIT_FAILURE;
     }
 